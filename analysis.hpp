@@ -0,0 +1,2026 @@
+#ifndef ANALYSIS_INCLUDED
+#define ANALYSIS_INCLUDED
+
+#include <utility>
+#include <algorithm>
+#include <limits>
+#include <cstdlib>
+
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+
+#include <map>
+#include <unordered_map>
+#include <forward_list>
+#include <deque>
+#include <array>
+
+#include "fastq_reader.hpp"
+#include "pipeline.hpp"
+#include "arena.hpp"
+#include "sequence_encoder.hpp"
+#include "output_writer.hpp"
+#include "pair_format.hpp"
+
+
+/*
+ * The duplicate analysis of suprDUPr: the record parser, the hash tables and
+ * the analysis loop. The main program is in suprDUPr.cpp.
+ *
+ * The analysis loop is compiled separately for each output and sorting mode,
+ * and for each sequence length (TwoBitSequence<N>); see selectAnalysisLoop.
+ * This makes 120 instances, so the instances for each length are compiled in
+ * a separate translation unit, analysis_loop.cpp, which the Makefile builds
+ * once for each length. The other translation units only see the explicit
+ * instantiation declarations at the bottom of this file.
+ *
+ * The hash function for the sequences is a multiply-xorshift hash over all
+ * the data. If the macro SIMPLE_HASH is defined, the sum of the 2-bit encoded
+ * words is used instead, as in earlier versions (faster, but many similar
+ * sequences get the same hash).
+ */
+
+// Number of reads processed together in a ReadBatch
+#define BATCH_SIZE 4096
+
+// Default number of reads to look ahead when prefetching hash table buckets
+#define PREFETCH_DISTANCE 8
+
+// The chained hash table grows when there are more entries than this number
+// times the number of buckets. When it grows, this many buckets are moved to
+// the new table for each read entered.
+#define MAX_LOAD_FACTOR 1
+#define REHASH_STEP 4
+
+using namespace std;
+
+
+// TwoBitSequence:
+// Class to hold a fixed length nucleotide sequence, in an efficient two-bit
+// encoding. It's mainly use for equality comparisons, so it has no method to
+// recover the original string.
+template <size_t N>
+class TwoBitSequence {
+ 
+public:
+    // SequenceBuffer type -- Used as a buffer for data input. Can appear as both
+    // a char array and a long array.
+    struct SequenceBuffer {
+        union {
+            unsigned long data[N*4];
+            char char_data[N*4*8];
+        };
+    };
+
+    unsigned long data[N] = {};
+    // Have half the number of unk's for N bases, but round up
+    unsigned long unk[(N+1)/2] = {};
+
+    inline TwoBitSequence() {}
+
+    // Encodes a single sequence. The sequence length is not needed. It is the
+    // responsibility of the caller to call the TwoBitSequence<N> with the
+    // correct N, where N is seq_len/32 rounded up. Also, the buffer passed to
+    // the constructor must be at least N*32 bytes long, zero padded if
+    // necessary. See sequence_encoder.hpp for the encoding.
+    inline TwoBitSequence(const unsigned long* blocks) {
+        encodeSequencesPortable<N>(blocks, data, 1);
+    }
+
+    // Encodes count sequences from the buffers in, using the fastest encoder
+    // for the CPU.
+    static void encode(const SequenceBuffer* in, TwoBitSequence* out, size_t count) {
+        static_assert(sizeof(TwoBitSequence) == sizeof(unsigned long) * (N + (N+1)/2),
+                "The encoders require the unk words to follow the data words");
+        static const SequenceEncoder<N> encoder = selectSequenceEncoder<N>();
+        encoder(in->data, out->data, count);
+    }
+
+    inline bool operator==(const TwoBitSequence& other) const {
+        for (size_t i=0; i<N; ++i) {
+            if (data[i] != other.data[i]) 
+                return false;
+        }
+        for (size_t i=0; i<(N+1)/2; ++i) {
+            if (unk[i] != other.unk[i])
+                return false;
+        }
+        return true;
+    }
+
+#ifdef SIMPLE_HASH
+    // Computes a simple, fast hash of the sequence.
+    inline size_t hash() const {
+        // Hash ignores unk; treats N as G. As N is uncommon, it's 
+        // not worth the effort.
+        size_t hash = 0;
+        for (size_t i=0; i<N; ++i) {
+            hash += data[i];
+        }
+        return hash;
+    }
+#else
+    // Computes a hash of the sequence, including the N flags. Each word is mixed
+    // into the state by a multiplication and xor-shift, so that all bits of the
+    // sequence affect the low bits, which are used to select the bucket.
+    inline size_t hash() const {
+        uint64_t hash = N;
+        for (size_t i=0; i<N; ++i) {
+            hash = (hash ^ data[i]) * 0xbf58476d1ce4e5b9ul;
+            hash ^= hash >> 29;
+        }
+        for (size_t i=0; i<(N+1)/2; ++i) {
+            hash = (hash ^ unk[i]) * 0xbf58476d1ce4e5b9ul;
+            hash ^= hash >> 29;
+        }
+        hash ^= hash >> 32;
+        hash *= 0x94d049bb133111ebul;
+        hash ^= hash >> 31;
+        return hash;
+    }
+#endif
+};
+
+
+// Sorting modes of the input file, used as template parameters of the analysis
+// heads. In sorted mode, the reads are sorted by y coordinate within each group
+// (tile), so the entries more than winy above the current read can be removed
+// from the hash table. In unsorted mode, the reads from different groups are
+// interleaved, so the entries from other groups are kept; in the other modes all
+// the entries of a group are removed when the next group starts. The group of
+// each entry is then not needed: EntryGroup is the type which is stored in the
+// entries for the group.
+struct GroupField {
+    int group;
+    GroupField(int group) : group(group) {}
+    bool inGroup(int other) const { return group == other; }
+};
+
+struct NoGroupField {
+    NoGroupField(int) {}
+    bool inGroup(int) const { return true; }
+};
+
+// In sorted mode, the entries are removed in the order they were entered, when
+// their row falls out of the window. EntryLinks is the type which is stored in
+// the entries for this: the previous entry in the list, so that the entry can be
+// unlinked without walking the list, and the next entry in the order of
+// insertion. The indices are 0 for none.
+struct RetireLinks {
+    uint32_t prev = 0, retire_next = 0;
+    uint32_t prevEntry() const { return prev; }
+    void setPrevEntry(uint32_t index) { prev = index; }
+    uint32_t retireNext() const { return retire_next; }
+    void setRetireNext(uint32_t index) { retire_next = index; }
+};
+
+struct NoRetireLinks {
+    uint32_t prevEntry() const { return 0; }
+    void setPrevEntry(uint32_t) {}
+    uint32_t retireNext() const { return 0; }
+    void setRetireNext(uint32_t) {}
+};
+
+struct SortedMode {
+    static const bool evict_rows = true;
+    static const bool interleaved_groups = false;
+    typedef NoGroupField EntryGroup;
+    typedef RetireLinks EntryLinks;
+};
+
+struct RegionSortedMode {
+    static const bool evict_rows = false;
+    static const bool interleaved_groups = false;
+    typedef NoGroupField EntryGroup;
+    typedef NoRetireLinks EntryLinks;
+};
+
+struct UnsortedMode {
+    static const bool evict_rows = false;
+    static const bool interleaved_groups = true;
+    typedef GroupField EntryGroup;
+    typedef NoRetireLinks EntryLinks;
+};
+
+// The prefix of the read-IDs of a group: the header up to the x coordinate,
+// without the "@". The index is unique for each prefix (group - 1).
+struct ReadIdPrefix {
+    string text;
+    uint32_t index;
+};
+
+// Output policies (sinks) of the analysis heads. The sink determines which
+// matches are needed, and what is output for each match. The ReadId type is
+// stored in each entry; it is empty if the read-ID is not needed. If
+// writes_output is false, the analysis only produces the Metrics. A ReadId
+// is made from the interned prefix of the read-ID (see RecordParser), and
+// the read-ID is rebuilt from the prefix and the coordinates for output.
+// Each head has its own copy of the sink, for the state of its output.
+//
+// CountingSink only counts the reads which have a duplicate, so the search
+// stops at the first match.
+struct CountingSink {
+    static const bool all_matches = false;
+    static const bool store_ids = false;
+    static const bool writes_output = false;
+
+    struct ReadId {
+        ReadId(const ReadIdPrefix*) {}
+    };
+
+    void match(ostream&, const ReadId&, int, int, const ReadId&, int, int) {}
+};
+
+// ReadIdSink outputs a line with the read-IDs of the read and the earlier
+// read, separated by a tab, for every match. Only a pointer to the prefix is
+// stored for each read, so the memory use is close to that of CountingSink.
+// If binary is set, the pairs are written in the binary format of
+// pair_format.hpp instead.
+struct ReadIdSink {
+    static const bool all_matches = true;
+    static const bool store_ids = true;
+    static const bool writes_output = true;
+
+    struct ReadId {
+        const ReadIdPrefix* prefix;
+        ReadId(const ReadIdPrefix* prefix) : prefix(prefix) {}
+    };
+
+    bool binary;
+    // Prefixes which have been written to this head's output (binary format)
+    vector<bool> defined_prefixes;
+
+    ReadIdSink(bool binary) : binary(binary) {}
+
+    // The line is written directly to the stream buffer, which is much faster
+    // than formatted output for millions of lines. Write errors are detected
+    // by the output stream's owner.
+    void match(ostream& out, const ReadId& read, int x, int y,
+            const ReadId& other, int other_x, int other_y) {
+        streambuf& buf = *out.rdbuf();
+        if (binary) {
+            // Duplicates are only found in the same group, so the reads have
+            // the same prefix
+            writeBinaryPair(buf, *read.prefix, x, y, other_x, other_y);
+            return;
+        }
+        buf.sputn(read.prefix->text.data(), read.prefix->text.size());
+        writeCoordinates(buf, x, y, '\t');
+        buf.sputn(other.prefix->text.data(), other.prefix->text.size());
+        writeCoordinates(buf, other_x, other_y, '\n');
+    }
+
+    // The prefix is defined the first time it is used in this output. In
+    // tile-parallel mode, the outputs of the heads are concatenated in the
+    // order of the tiles, so the definition always comes before the pairs.
+    void writeBinaryPair(streambuf& buf, const ReadIdPrefix& prefix, int x, int y,
+            int other_x, int other_y) {
+        if (prefix.index >= defined_prefixes.size()) {
+            defined_prefixes.resize(prefix.index + 1);
+        }
+        if (!defined_prefixes[prefix.index]) {
+            buf.sputc(pair_format_prefix_tag);
+            writeVarint(buf, prefix.index);
+            writeVarint(buf, prefix.text.size());
+            buf.sputn(prefix.text.data(), prefix.text.size());
+            defined_prefixes[prefix.index] = true;
+        }
+        buf.sputc(pair_format_pair_tag);
+        writeVarint(buf, prefix.index);
+        writeVarint(buf, x);
+        writeVarint(buf, y);
+        writeVarint(buf, other_x);
+        writeVarint(buf, other_y);
+    }
+
+    // Writes "x:y" and the separator. The coordinates are never negative
+    // (checked by the parser).
+    static void writeCoordinates(streambuf& buf, int x, int y, char separator) {
+        char buffer[24];
+        char* end = buffer + sizeof(buffer);
+        char* p = end;
+        *--p = separator;
+        do { *--p = '0' + y % 10; y /= 10; } while (y);
+        *--p = ':';
+        do { *--p = '0' + x % 10; x /= 10; } while (x);
+        buf.sputn(p, end - p);
+    }
+};
+
+
+// Entry:
+// This class represents a single sequence read at a specific position 
+// inside a physical region (tile). It holds the coordinates and the 
+// sequence, the group if the MODE needs it, and the read-ID prefix if the
+// SINK needs it. The prefix strings are owned by the RecordParser, so the
+// Entry is trivially destructible, and can be allocated by an IndexPool.
+// The next entry in the list is referred to by its index in the pool (0 at
+// the end of the list). The tag is the high half of the hash of the
+// sequence, which is compared before the sequences themselves.
+//
+// Without read-IDs, the entry takes 16 bytes plus the sequence in
+// region-sorted mode, and 24 bytes plus the sequence in sorted mode, with
+// the links for retiring it.
+template<typename VALUE, typename MODE, typename SINK>
+class Entry : public SINK::ReadId, public MODE::EntryGroup, public MODE::EntryLinks {
+    public:
+        uint32_t next = 0;
+        uint32_t tag;
+        int x, y;
+        VALUE value;
+
+        Entry(int group, int x, int y, uint32_t tag, const ReadIdPrefix* prefix,
+                const VALUE& value) :
+            SINK::ReadId(prefix), MODE::EntryGroup(group), tag(tag), x(x), y(y),
+            value(value) {
+        }
+
+        static uint32_t hashTag(size_t hash) {
+            return hash >> 32;
+        }
+};
+
+// ReadBatch:
+// A batch of reads in structure-of-arrays layout. The RecordParser fills in
+// the coordinates and the sequence characters, then encode() computes the
+// TwoBitSequence values and their hashes for the whole batch in one loop.
+// The batch is then given to AnalysisHead::enterBatch, which marks the reads
+// which are duplicates of an earlier read.
+//
+// If the filtered FASTQ output is enabled, the batch also holds the text of
+// the records, so they can be written after the analysis. This includes the
+// records which are too short to be analysed, which are always written.
+template<typename VALUE>
+class ReadBatch {
+    public:
+        const size_t capacity;
+        size_t size = 0;
+        vector<int> group, x, y;
+        vector<typename VALUE::SequenceBuffer> sequence;
+        vector<VALUE> value;
+        vector<size_t> hash;
+        // Interned read-ID prefix (the header up to the coordinates, without
+        // the "@"), or null if the read-IDs are not needed by the output
+        vector<const ReadIdPrefix*> prefix;
+        vector<char> duplicate;
+
+        // Records for the filtered output, in the input order: the text of the
+        // read 1 and read 2 records back to back, the end of each record, and
+        // whether the record is one of the reads in the batch.
+        vector<char> record_data[2];
+        vector<size_t> record_end[2];
+        vector<char> record_analysed;
+
+        ReadBatch(size_t capacity) :
+            capacity(capacity), group(capacity), x(capacity), y(capacity),
+            sequence(capacity), value(capacity), hash(capacity), prefix(capacity),
+            duplicate(capacity) {
+        }
+
+        void clear() {
+            size = 0;
+            for (int r=0; r<2; ++r) {
+                record_data[r].clear();
+                record_end[r].clear();
+            }
+            record_analysed.clear();
+        }
+
+        // Adds the text of a record for the filtered output (r = 0 for read 1,
+        // 1 for read 2). A newline is added if it is missing at the end of the
+        // file.
+        void addRecord(int r, const FastqRecord& rec) {
+            record_data[r].insert(record_data[r].end(), rec.header, rec.header + rec.record_len);
+            if (record_data[r].back() != '\n') {
+                record_data[r].push_back('\n');
+            }
+            record_end[r].push_back(record_data[r].size());
+        }
+
+        // Writes the records which are not duplicates of an earlier read. Runs
+        // of records which are kept are written together.
+        void writeFiltered(ostream& output, int r) const {
+            streambuf& buf = *output.rdbuf();
+            size_t read = 0, run_start = 0, pos = 0;
+            for (size_t i=0; i<record_end[r].size(); ++i) {
+                const bool keep = !(record_analysed[i] && duplicate[read]);
+                if (record_analysed[i]) ++read;
+                if (!keep) {
+                    buf.sputn(record_data[r].data() + run_start, pos - run_start);
+                    run_start = record_end[r][i];
+                }
+                pos = record_end[r][i];
+            }
+            buf.sputn(record_data[r].data() + run_start, pos - run_start);
+        }
+
+        void encode() {
+            VALUE::encode(sequence.data(), value.data(), size);
+            for (size_t i=0; i<size; ++i) {
+                hash[i] = value[i].hash();
+            }
+        }
+
+        // Copies an encoded read from another batch to the end of this batch
+        void append(const ReadBatch& other, size_t i) {
+            size_t j = size++;
+            group[j] = other.group[i];
+            x[j] = other.x[i];
+            y[j] = other.y[i];
+            value[j] = other.value[i];
+            hash[j] = other.hash[i];
+            prefix[j] = other.prefix[i];
+        }
+};
+
+// Histogram of lengths, for the hash table statistics. Lengths up to 15 have
+// separate bins, and longer lengths are binned by powers of 2.
+class Histogram {
+    public:
+        vector<unsigned long> counts;
+
+        void add(size_t length) {
+            size_t bin = length < 16 ? length : 12 + (63 - __builtin_clzl(length));
+            if (bin >= counts.size()) {
+                counts.resize(bin + 1);
+            }
+            counts[bin]++;
+        }
+
+        Histogram& operator +=(const Histogram& other) {
+            if (other.counts.size() > counts.size()) {
+                counts.resize(other.counts.size());
+            }
+            for (size_t i=0; i<other.counts.size(); ++i) {
+                counts[i] += other.counts[i];
+            }
+            return *this;
+        }
+
+        void print(ostream& out, const string& title) const {
+            unsigned long total = 0;
+            double sum = 0;
+            out << title << '\n';
+            for (size_t i=0; i<counts.size(); ++i) {
+                size_t low = i < 16 ? i : (size_t)1 << (i - 12);
+                size_t high = i < 16 ? i : low * 2 - 1;
+                total += counts[i];
+                sum += counts[i] * (low + high) / 2.0;
+                if (counts[i] == 0) continue;
+                if (low == high) out << setw(12) << low;
+                else out << setw(5) << low << " - " << setw(4) << high;
+                out << '\t' << counts[i] << '\n';
+            }
+            out << "Mean: " << (total > 0 ? sum / total : 0.0) << '\n';
+        }
+};
+
+// DuplicateSets:
+// Groups the reads into sets of local duplicates (the reads connected by the
+// duplicate relation), using a union-find structure, for the distribution of
+// the set sizes. Only the reads with a duplicate are in a set. The set of each
+// entry in the head's table is stored separately, indexed by the entry index,
+// so the entries don't grow. The set of an entry is valid until the index is
+// reused for a new read, which always assigns it again.
+//
+// For each new read, match() is called for every earlier read which it
+// duplicates, and then enter() with the new read's entry index.
+class DuplicateSets {
+        // Set of each entry index; 0 for none
+        vector<uint32_t> entry_set;
+        // Parent of each set, and the number of reads in each root set. Set 0 is
+        // not used.
+        vector<uint32_t> parent, size;
+        // Set of the read which is being entered
+        uint32_t current = 0;
+
+        uint32_t find(uint32_t set) {
+            while (parent[set] != set) {
+                parent[set] = parent[parent[set]];
+                set = parent[set];
+            }
+            return set;
+        }
+
+    public:
+        DuplicateSets() : parent(1), size(1) {}
+
+        void match(uint32_t entry) {
+            uint32_t set = entry_set[entry];
+            if (set == 0) {
+                // The earlier read had no duplicates before
+                if (current == 0) {
+                    current = parent.size();
+                    parent.push_back(current);
+                    size.push_back(0);
+                }
+                entry_set[entry] = current;
+                size[current]++;
+            }
+            else {
+                set = find(set);
+                if (current == 0) {
+                    current = set;
+                }
+                else if (set != current) {
+                    // Union by size
+                    if (size[set] > size[current]) swap(set, current);
+                    parent[set] = current;
+                    size[current] += size[set];
+                }
+            }
+        }
+
+        void enter(uint32_t entry) {
+            if (entry >= entry_set.size()) {
+                entry_set.resize(max<size_t>(entry + 1, entry_set.size() * 2));
+            }
+            entry_set[entry] = current;
+            if (current != 0) {
+                size[current]++;
+                current = 0;
+            }
+        }
+
+        // Called when the entries are moved: entry i is now old_entries[i]
+        void renumber(const vector<uint32_t>& old_entries) {
+            vector<uint32_t> new_entry_set(max(entry_set.size(), old_entries.size()));
+            for (size_t i=0; i<old_entries.size(); ++i) {
+                new_entry_set[i] = entry_set[old_entries[i]];
+            }
+            entry_set.swap(new_entry_set);
+        }
+
+        // Adds the sizes of the sets to the histogram, and removes all sets
+        void finish(Histogram& set_sizes) {
+            for (size_t set=1; set<parent.size(); ++set) {
+                if (parent[set] == set) {
+                    set_sizes.add(size[set]);
+                }
+            }
+            fill(entry_set.begin(), entry_set.end(), 0);
+            parent.resize(1);
+            size.resize(1);
+        }
+};
+
+// Metrics is used to pass results from the analysisLoop function back
+// into the main program.
+class Metrics {
+    // Collects totals
+    public:
+        bool error = false;
+        unsigned long reads_with_duplicates = 0;
+        unsigned long num_reads = 0;
+        // Final size of the hash table(s)
+        size_t table_bytes = 0;
+        // Hash table statistics, if enabled: the number of entries examined for
+        // each read, and the lengths of all lists (or clusters, for the open
+        // table) at the end of each group.
+        Histogram walk_lengths, list_lengths;
+        // Sizes of the sets of local duplicates, if enabled
+        Histogram set_sizes;
+
+        Metrics& operator +=(const Metrics& other) {
+            error = error || other.error;
+            reads_with_duplicates += other.reads_with_duplicates;
+            num_reads += other.num_reads;
+            table_bytes += other.table_bytes;
+            walk_lengths += other.walk_lengths;
+            list_lengths += other.list_lengths;
+            set_sizes += other.set_sizes;
+            return *this;
+        }
+};
+
+// Called when a head can't store any more reads, as the entries are
+// identified by 32-bit indices. All the reads are kept in unsorted mode, so
+// this is where the limit can be reached (in the other modes it applies to
+// each tile). The analysis runs in several threads, so the program exits.
+[[noreturn]] inline void tooManyReads() {
+    cerr << "ERROR: Too many reads for unsorted mode. At most 4294967295 reads "
+         << "can be stored in the hash table." << endl;
+    exit(1);
+}
+
+/* The AnalysisHead class receives read one by one from the analysis loop,
+ * and manages the processing of rows, and groups (tiles). The enterPoint
+ * function is the critical piece of code, which checks for duplicates.
+ *
+ * The hash table grows when the number of entries exceeds MAX_LOAD_FACTOR
+ * times the number of buckets. The entries are moved to the new table
+ * incrementally: while the old table exists, buckets at index rehash_pos and
+ * above are still in the old table. If shrink is set, the table is resized
+ * to fit the largest number of entries in the previous group, when a new group
+ * starts.
+ *
+ * In sorted mode, the entries which are more than winy above the current read
+ * are removed before each read is entered. The entries are linked in the order
+ * of insertion, which is the order of y, so the oldest ones are removed first,
+ * and each entry is unlinked from its list through its link to the previous
+ * entry, without walking the list. The cost per read is thus constant, even if
+ * a list holds many copies of the same sequence. The number of entries is
+ * limited by the number of reads in the window, not in the whole tile, and the
+ * table doesn't grow beyond that. In the other modes, the lists are only walked
+ * to find the duplicates, and the entries out of the window are skipped.
+ *
+ * The sorting mode (MODE) and the output (SINK) are template parameters, so
+ * that the checks for them are resolved at compile time. */
+template<typename VALUE, typename MODE, typename SINK>
+class AnalysisHead {
+
+    ostream& outout;
+    SINK sink;
+
+    size_t hash_size;
+    size_t mask;
+    const size_t min_hash_size;
+    int winx, winy;
+    const bool shrink, stats, set_sizes;
+    const size_t prefetch_distance;
+    DuplicateSets sets;
+
+    typedef Entry<VALUE, MODE, SINK> Ent;
+    // The buckets contain the index of the first entry in the list, or 0
+    uint32_t* data = nullptr;
+    uint32_t* old_data = nullptr;
+    size_t old_size = 0, rehash_pos = 0;
+    size_t num_entries = 0, max_entries = 0;
+
+    // The oldest and the newest entry, in the order of insertion (sorted mode
+    // only)
+    uint32_t retire_head = 0, retire_tail = 0;
+
+    // Memory for the entries. All entries are released when a group ends,
+    // except in unsorted mode.
+    IndexPool<Ent> entries;
+    int current_group = 0;
+
+    public:
+    typedef SINK Sink;
+    Metrics metrics;
+        
+        AnalysisHead(ostream& outout, const SINK& sink,
+                size_t hash_bytes, unsigned int winx, unsigned int winy, bool shrink,
+                bool stats, bool set_sizes, unsigned int prefetch_distance)
+            : outout(outout), sink(sink), min_hash_size(tableSize(hash_bytes/sizeof(uint32_t))),
+                winx(winx), winy(winy), shrink(shrink), stats(stats), set_sizes(set_sizes),
+                prefetch_distance(prefetch_distance) {
+            allocate(min_hash_size);
+        }
+
+        ~AnalysisHead() {
+            delete[] data;
+            delete[] old_data;
+        }
+
+        // Enters all reads in the batch, in order. The lookups are pipelined
+        // in two steps: the hash table bucket is prefetched prefetch_distance
+        // reads ahead of the current read, and the first entry in the bucket
+        // half as many reads ahead. Reading the bucket to find the entry is a
+        // normal load, so it is only done for buckets which were prefetched at
+        // least prefetch_distance - entry_distance reads earlier, and have
+        // (hopefully) arrived in the cache; the first reads of the batch only
+        // get the bucket prefetch. The prefetches are only hints, so it doesn't
+        // matter if the list is changed by the reads in between.
+        // If halo is true, the reads are only added to the table, to be compared
+        // with the following reads; they are not counted, and not reported as
+        // duplicates.
+        void enterBatch(ReadBatch<VALUE>& batch, bool halo = false) {
+            const size_t entry_distance = prefetch_distance / 2;
+            for (size_t i=0; i<prefetch_distance && i<batch.size; ++i) {
+                __builtin_prefetch(bucket(batch.hash[i]));
+            }
+            for (size_t i=0; i<batch.size; ++i) {
+                if (prefetch_distance > 0) {
+                    if (i + prefetch_distance < batch.size) {
+                        __builtin_prefetch(bucket(batch.hash[i + prefetch_distance]));
+                    }
+                    if (entry_distance > 0 && i >= prefetch_distance - entry_distance
+                            && i + entry_distance < batch.size) {
+                        __builtin_prefetch(entries.address(*bucket(batch.hash[i + entry_distance])));
+                    }
+                }
+                batch.duplicate[i] = enterPoint(batch.group[i], batch.x[i], batch.y[i],
+                        batch.prefix[i], batch.value[i], batch.hash[i], halo);
+            }
+        }
+
+        // Returns true if the read is a duplicate of an earlier read
+        bool enterPoint(int group, int x, int y, const ReadIdPrefix* prefix,
+                const VALUE& value, size_t hash, bool halo = false) {
+            if (group != current_group) {
+                startGroup(group);
+            }
+            if (MODE::evict_rows) {
+                retireRows(y);
+            }
+            const uint32_t new_index = entries.allocate();
+            if (new_index == 0) {
+                tooManyReads();
+            }
+            Ent* new_entry = new (&entries[new_index]) Ent(group, x, y, Ent::hashTag(hash),
+                    prefix, value);
+            uint32_t* entry_ptr = bucket(hash);
+            uint32_t prev_index = 0;
+            bool any_duplicate_found = false;
+            size_t walk_length = 0;
+            while (*entry_ptr) {
+                const uint32_t index = *entry_ptr;
+                Ent* entry = &entries[index];
+                ++walk_length;
+                // Entries out of the window (region-sorted mode; in sorted mode
+                // they have already been retired) and entries from other groups
+                // (unsorted mode) are skipped
+                if ((y - entry->y) <= winy && entry->inGroup(group)
+                        && entry->tag == new_entry->tag
+                        && abs(entry->x - x) < winx
+                        && entry->value == new_entry->value) {
+                    any_duplicate_found = true;
+                    if (set_sizes) {
+                        sets.match(index);
+                    }
+                    else if (!SINK::all_matches) {
+                        // Break out of the loop on the first match, to work
+                        // better on files with high duplication ratio. (All
+                        // the matches are needed for the duplicate sets.)
+                        new_entry->next = index;
+                        entry->setPrevEntry(new_index);
+                        break;
+                    }
+                    if (!halo) {
+                        sink.match(outout, *new_entry, x, y, *entry, entry->x, entry->y);
+                    }
+                }
+                prev_index = index;
+                entry_ptr = &entry->next;
+            }
+            if (!halo) {
+                if (any_duplicate_found) {
+                    metrics.reads_with_duplicates++;
+                }
+                metrics.num_reads++;
+            }
+            *entry_ptr = new_index;
+            new_entry->setPrevEntry(prev_index);
+            if (MODE::evict_rows) {
+                if (retire_tail) {
+                    entries[retire_tail].setRetireNext(new_index);
+                }
+                else {
+                    retire_head = new_index;
+                }
+                retire_tail = new_index;
+            }
+            if (set_sizes) {
+                sets.enter(new_index);
+            }
+            if (stats) {
+                metrics.walk_lengths.add(walk_length);
+            }
+
+            if (++num_entries > max_entries) {
+                max_entries = num_entries;
+            }
+            if (old_data) {
+                rehashStep();
+            }
+            else if (num_entries > hash_size * MAX_LOAD_FACTOR) {
+                startRehash();
+            }
+            return any_duplicate_found;
+        }
+
+        // Called at the end of the input
+        void finish() {
+            if (stats) {
+                addListLengths();
+            }
+            if (set_sizes) {
+                sets.finish(metrics.set_sizes);
+            }
+        }
+
+    private:
+
+        // Adds the lengths of all the lists to the statistics
+        void addListLengths() {
+            if (old_data) {
+                for (size_t i=rehash_pos; i<old_size; ++i) {
+                    metrics.list_lengths.add(listLength(old_data[i]));
+                }
+            }
+            for (size_t i=0; i<hash_size; ++i) {
+                if (!old_data || (i & (old_size - 1)) < rehash_pos) {
+                    metrics.list_lengths.add(listLength(data[i]));
+                }
+            }
+        }
+
+        // Removes the entries which are out of the window at row y, oldest first.
+        // An entry without a previous entry is the first in its list.
+        void retireRows(int y) {
+            while (retire_head && (y - entries[retire_head].y) > winy) {
+                const uint32_t index = retire_head;
+                Ent& entry = entries[index];
+                retire_head = entry.retireNext();
+                const uint32_t prev = entry.prevEntry();
+                if (prev) {
+                    entries[prev].next = entry.next;
+                }
+                else {
+                    *bucket(entry.value.hash()) = entry.next;
+                }
+                if (entry.next) {
+                    entries[entry.next].setPrevEntry(prev);
+                }
+                entries.release(index);
+                --num_entries;
+            }
+            if (!retire_head) {
+                retire_tail = 0;
+            }
+        }
+
+        size_t listLength(uint32_t index) {
+            size_t length = 0;
+            for (; index; index = entries[index].next) ++length;
+            return length;
+        }
+
+        // Rounds up to a power of 2. There are never more than 2^32 entries, so
+        // more buckets are not needed.
+        static size_t tableSize(size_t min_size) {
+            size_t size = 1024;
+            while (size < min_size && size < ((size_t)1 << 32)) size *= 2;
+            return size;
+        }
+
+        void allocate(size_t size) {
+            delete[] data;
+            hash_size = size;
+            mask = hash_size - 1;
+            data = new uint32_t[hash_size]();
+            metrics.table_bytes = hash_size * sizeof(uint32_t);
+        }
+
+        // Returns the list for the hash, in the old or the new table
+        uint32_t* bucket(size_t hash) {
+            if (old_data) {
+                size_t old_index = hash & (old_size - 1);
+                if (old_index >= rehash_pos) {
+                    return &old_data[old_index];
+                }
+            }
+            return &data[hash & mask];
+        }
+
+        // Starts moving the entries to a table of twice the size
+        void startRehash() {
+            old_data = data;
+            old_size = hash_size;
+            rehash_pos = 0;
+            data = nullptr;
+            allocate(old_size * 2);
+        }
+
+        // Moves the next REHASH_STEP lists from the old table. Each list is split
+        // into two lists in the new table, keeping the order of the entries.
+        void rehashStep() {
+            for (int i=0; i<REHASH_STEP && rehash_pos < old_size; ++i, ++rehash_pos) {
+                uint32_t* tail_low = &data[rehash_pos];
+                uint32_t* tail_high = &data[rehash_pos + old_size];
+                uint32_t last_low = 0, last_high = 0;
+                for (uint32_t index = old_data[rehash_pos]; index; ) {
+                    Ent& entry = entries[index];
+                    const uint32_t next = entry.next;
+                    const bool low = (entry.value.hash() & mask) == rehash_pos;
+                    uint32_t*& tail = low ? tail_low : tail_high;
+                    uint32_t& last = low ? last_low : last_high;
+                    *tail = index;
+                    entry.setPrevEntry(last);
+                    last = index;
+                    tail = &entry.next;
+                    index = next;
+                }
+                *tail_low = 0;
+                *tail_high = 0;
+            }
+            if (rehash_pos == old_size) {
+                delete[] old_data;
+                old_data = nullptr;
+            }
+        }
+
+        // Called when the first read of a new group is entered. Except in unsorted
+        // mode, the groups are not interleaved, so the entries from the previous
+        // group can all be removed at once.
+        void startGroup(int group) {
+            if (stats && current_group != 0 && !MODE::interleaved_groups) {
+                addListLengths();
+            }
+            if (!MODE::interleaved_groups) {
+                if (set_sizes) {
+                    sets.finish(metrics.set_sizes);
+                }
+                delete[] old_data;
+                old_data = nullptr;
+                size_t new_size = shrink ?
+                    max(min_hash_size, tableSize(max_entries / MAX_LOAD_FACTOR)) : hash_size;
+                if (new_size < hash_size) {
+                    allocate(new_size);
+                }
+                else {
+                    memset(data, 0, hash_size * sizeof(uint32_t));
+                }
+                entries.clear();
+                retire_head = 0;
+                retire_tail = 0;
+                num_entries = 0;
+                max_entries = 0;
+            }
+            current_group = group;
+        }
+};
+
+/* OpenAnalysisHead is an alternative to AnalysisHead, with the same interface and
+ * the same results. It uses an open addressing hash table with linear probing.
+ * Each slot holds a fingerprint of the hash and the coordinates of a read, so
+ * most of the reads in a probe sequence can be rejected without accessing
+ * any other memory. The sequences are stored in a separate, dense array of
+ * records, which is only accessed when the fingerprint and x coordinate match.
+ *
+ * In sorted mode, slots that are out of the y window are dead: they are skipped
+ * by lookups, and reused by inserts. When more than 3/4 of the slots are in use
+ * (live or dead), the table is rebuilt with only the live slots, and the
+ * capacity is doubled if more than half of the slots would still be used. */
+template<typename VALUE, typename MODE, typename SINK>
+class OpenAnalysisHead {
+
+    struct Slot {
+        uint32_t fingerprint; // 0 means the slot is empty
+        uint32_t index;       // Index in the records array
+        int x, y;
+    };
+
+    // Insertion order of a record, to report all the matches in order. It is
+    // only stored if the SINK needs all matches.
+    struct InsertionOrder {
+        unsigned long order;
+        InsertionOrder(unsigned long order) : order(order) {}
+        unsigned long insertionOrder() const { return order; }
+    };
+    struct NoInsertionOrder {
+        NoInsertionOrder(unsigned long) {}
+        unsigned long insertionOrder() const { return 0; }
+    };
+    typedef typename conditional<SINK::all_matches, InsertionOrder, NoInsertionOrder>::type
+        Order;
+
+    struct Record : SINK::ReadId, Order, MODE::EntryGroup {
+        VALUE value;
+
+        Record(const VALUE& value, int group, const ReadIdPrefix* prefix,
+                unsigned long order) :
+            SINK::ReadId(prefix), Order(order), MODE::EntryGroup(group), value(value) {
+        }
+    };
+
+    static const size_t no_slot = ~(size_t)0;
+
+    // Where the last search for a free slot stopped, for a few home slots. Many
+    // copies of one sequence have the same home, and after its first match, the
+    // next copy can continue from there instead of scanning the run again.
+    struct RunEnd {
+        size_t home, end;
+    };
+    static const size_t run_end_cache_size = 256;
+
+    ostream& outout;
+    SINK sink;
+    int winx, winy;
+
+    const bool shrink, stats, set_sizes;
+    // The search can stop at the first match, unless all the matches are
+    // needed by the SINK or for the duplicate sets
+    const bool stop_on_match;
+    const size_t prefetch_distance;
+    vector<Slot> slots;
+    size_t mask, min_capacity;
+    size_t used = 0, max_used = 0;
+    vector<Record> records;
+    array<RunEnd, run_end_cache_size> run_ends;
+    int current_group = 0;
+    unsigned long next_order = 0;
+    // Matches of the current read: insertion order and slot position
+    vector<pair<unsigned long, size_t>> matches;
+    DuplicateSets sets;
+
+    public:
+    typedef SINK Sink;
+    Metrics metrics;
+
+        OpenAnalysisHead(ostream& outout, const SINK& sink,
+                size_t hash_bytes, unsigned int winx, unsigned int winy, bool shrink,
+                bool stats, bool set_sizes, unsigned int prefetch_distance)
+            : outout(outout), sink(sink), winx(winx), winy(winy), shrink(shrink), stats(stats),
+                set_sizes(set_sizes), stop_on_match(!SINK::all_matches && !set_sizes),
+                prefetch_distance(prefetch_distance) {
+            // Use one slot for each 8 bytes of hash_bytes, rounded down to a power
+            // of 2
+            size_t capacity = 1024;
+            while (capacity * 2 <= hash_bytes / sizeof(void*)) capacity *= 2;
+            min_capacity = capacity;
+            resize(capacity);
+        }
+
+        void enterBatch(ReadBatch<VALUE>& batch, bool halo = false) {
+            for (size_t i=0; i<prefetch_distance && i<batch.size; ++i) {
+                __builtin_prefetch(&slots[batch.hash[i] & mask]);
+            }
+            for (size_t i=0; i<batch.size; ++i) {
+                if (prefetch_distance > 0 && i + prefetch_distance < batch.size) {
+                    __builtin_prefetch(&slots[batch.hash[i + prefetch_distance] & mask]);
+                }
+                batch.duplicate[i] = enterPoint(batch.group[i], batch.x[i], batch.y[i],
+                        batch.prefix[i], batch.value[i], batch.hash[i], halo);
+            }
+        }
+
+        // Returns true if the read is a duplicate of an earlier read
+        bool enterPoint(int group, int x, int y, const ReadIdPrefix* prefix,
+                const VALUE& value, size_t hash, bool halo = false) {
+            if (group != current_group) {
+                startGroup(group);
+            }
+            const bool evict = MODE::evict_rows;
+            const uint32_t fp = fingerprint(hash);
+            const size_t home = hash & mask;
+            size_t pos = home, insert_pos = no_slot, probes = 0;
+            bool any_duplicate_found = false;
+            for (; slots[pos].fingerprint != 0; pos = (pos + 1) & mask, ++probes) {
+                const Slot& slot = slots[pos];
+                if ((y - slot.y) > winy) {
+                    if (evict && insert_pos == no_slot) {
+                        insert_pos = pos;
+                    }
+                }
+                else if (slot.fingerprint == fp && abs(slot.x - x) < winx) {
+                    const Record& record = records[slot.index];
+                    if (record.inGroup(group) && record.value == value) {
+                        any_duplicate_found = true;
+                        if (set_sizes) {
+                            sets.match(slot.index);
+                        }
+                        if (SINK::all_matches && !halo) {
+                            matches.emplace_back(record.insertionOrder(), pos);
+                        }
+                        if (stop_on_match) break;
+                    }
+                }
+            }
+            if (insert_pos == no_slot) {
+                insert_pos = freeSlot(home, pos, y, probes);
+            }
+
+            Record new_record(value, group, prefix, next_order++);
+            if (SINK::all_matches && !matches.empty()) {
+                // Report the matches in the order they were entered, like AnalysisHead
+                sort(matches.begin(), matches.end());
+                for (const auto& match : matches) {
+                    const Slot& slot = slots[match.second];
+                    sink.match(outout, new_record, x, y, records[slot.index], slot.x, slot.y);
+                }
+                matches.clear();
+            }
+            uint32_t index;
+            if (slots[insert_pos].fingerprint == 0) {
+                if (records.size() == numeric_limits<uint32_t>::max()) {
+                    tooManyReads();
+                }
+                index = records.size();
+                records.push_back(new_record);
+                ++used;
+            }
+            else {
+                index = slots[insert_pos].index;
+                records[index] = new_record;
+            }
+            slots[insert_pos] = Slot{fp, index, x, y};
+            if (set_sizes) {
+                sets.enter(index);
+            }
+
+            if (!halo) {
+                if (any_duplicate_found) {
+                    metrics.reads_with_duplicates++;
+                }
+                metrics.num_reads++;
+            }
+            if (stats) {
+                metrics.walk_lengths.add(probes);
+            }
+            if (used > max_used) {
+                max_used = used;
+            }
+            if (used > slots.size() / 4 * 3) {
+                rebuild(y);
+            }
+            return any_duplicate_found;
+        }
+
+        // Called at the end of the input
+        void finish() {
+            if (stats) {
+                addClusterLengths();
+            }
+            if (set_sizes) {
+                sets.finish(metrics.set_sizes);
+            }
+        }
+
+    private:
+
+        // Adds the lengths of all runs of used slots to the statistics. A
+        // run that wraps around the end is counted as two runs.
+        void addClusterLengths() {
+            size_t length = 0;
+            for (const Slot& slot : slots) {
+                if (slot.fingerprint != 0) {
+                    ++length;
+                }
+                else if (length > 0) {
+                    metrics.list_lengths.add(length);
+                    length = 0;
+                }
+            }
+            if (length > 0) {
+                metrics.list_lengths.add(length);
+            }
+        }
+
+        // Returns the slot for a new read whose probe sequence starts at home, and
+        // has reached the used slot at pos: the first dead slot from pos, or the
+        // empty slot at the end of the run. If an earlier search from the same home
+        // stopped further along the run, this one skips ahead to there: slots are
+        // only emptied by resize(), so the run still reaches that far.
+        size_t freeSlot(size_t home, size_t pos, int y, size_t& probes) {
+            RunEnd& run_end = run_ends[home & (run_end_cache_size - 1)];
+            if (run_end.home == home
+                    && ((run_end.end - home) & mask) > ((pos - home) & mask)) {
+                pos = run_end.end;
+            }
+            for (; slots[pos].fingerprint != 0; pos = (pos + 1) & mask, ++probes) {
+                if (MODE::evict_rows && (y - slots[pos].y) > winy) break;
+            }
+            run_end = RunEnd{home, pos};
+            return pos;
+        }
+
+        static uint32_t fingerprint(size_t hash) {
+            // Use different bits than the ones that select the slot. Never 0.
+            return (uint32_t)((hash * 0x9E3779B97F4A7C15ul) >> 32) | 1;
+        }
+
+        void resize(size_t capacity) {
+            slots.assign(capacity, Slot{0, 0, 0, 0});
+            run_ends.fill(RunEnd{no_slot, 0});
+            mask = capacity - 1;
+            metrics.table_bytes = capacity * sizeof(Slot);
+        }
+
+        void startGroup(int group) {
+            if (stats && current_group != 0 && !MODE::interleaved_groups) {
+                addClusterLengths();
+            }
+            if (!MODE::interleaved_groups) {
+                if (set_sizes) {
+                    sets.finish(metrics.set_sizes);
+                }
+                size_t capacity = slots.size();
+                if (shrink) {
+                    // Fit the previous group at a load of at most 1/2
+                    while (capacity > min_capacity && max_used * 4 <= capacity) capacity /= 2;
+                }
+                resize(capacity);
+                records.clear();
+                used = 0;
+                max_used = 0;
+            }
+            current_group = group;
+        }
+
+        // Rebuilds the table with only the slots which are live at coordinate y
+        void rebuild(int y) {
+            const bool evict = MODE::evict_rows;
+            size_t live = 0;
+            for (const Slot& slot : slots) {
+                if (slot.fingerprint != 0 && !(evict && (y - slot.y) > winy)) ++live;
+            }
+            size_t capacity = slots.size();
+            while (live * 2 > capacity) capacity *= 2;
+
+            vector<Slot> old_slots;
+            old_slots.swap(slots);
+            resize(capacity);
+            vector<Record> old_records;
+            old_records.swap(records);
+            records.reserve(live);
+            vector<uint32_t> old_indices;
+            used = 0;
+            for (const Slot& slot : old_slots) {
+                if (slot.fingerprint != 0 && !(evict && (y - slot.y) > winy)) {
+                    const Record& record = old_records[slot.index];
+                    size_t pos = record.value.hash() & mask;
+                    while (slots[pos].fingerprint != 0) pos = (pos + 1) & mask;
+                    slots[pos] = Slot{slot.fingerprint, (uint32_t)records.size(), slot.x, slot.y};
+                    records.push_back(record);
+                    if (set_sizes) old_indices.push_back(slot.index);
+                    ++used;
+                }
+            }
+            if (set_sizes) {
+                sets.renumber(old_indices);
+            }
+        }
+};
+
+inline int get_coordinate_position() {
+    return 0;
+}
+
+
+// This returns a result signifying an error.
+inline Metrics error() {
+    Metrics m;
+    m.error = true;
+    return m;
+}
+
+
+class HeaderFormat {
+
+public:
+    bool valid;
+    size_t start_to_coord_offset = 0;
+    HeaderFormat(const string& header) {
+
+        // Determine the header format. In Illumina format, the x coordinate
+        // is after the fifth colon and the y coordinate after the sixth 
+        // colon up to a space.
+        size_t colons = 0, end_coords = 0; // temporary variables
+        size_t i;
+        for (i=0; i<header.size(); ++i) {
+            if (header[i] == ':') {
+                ++colons;
+                if (colons == 5) start_to_coord_offset = i+1;
+            }
+            else if (header[i] == ' ') {
+                end_coords = i;
+            }
+        }
+        if (end_coords == 0)
+            end_coords = i;
+        valid = (colons >= 6);
+    }
+
+    bool operator ==(const HeaderFormat& other) {
+        return start_to_coord_offset == other.start_to_coord_offset &&
+                valid == other.valid;
+     }
+};
+
+/*
+ * The RecordParser reads records from the input file(s), and parses the coordinates
+ * and the region (tile) from the headers. It fills ReadBatches with the reads that are
+ * long enough to be analysed. It also checks that the file is sorted, and that
+ * the read 1 and read 2 files match.
+ *
+ * If split_groups is set, a batch never contains reads from more than one
+ * group, so that the groups can be analysed separately. If band_height is not 0,
+ * the batches are also split at multiples of band_height in the y coordinate.
+ *
+ * If store_ids is set, the prefix of the read-ID (the header up to the x
+ * coordinate) is stored once for each group, and the batches refer to it.
+ * The prefixes are kept until the parser is destroyed, and are never moved,
+ * so they can be used by the analysis threads while the parser adds more. The
+ * read-ID is rebuilt from the prefix and the coordinates, so the coordinates
+ * must be written as plain decimal numbers.
+ *
+ * If keep_records is set, the text of all the records is copied into the
+ * batches, for the filtered output. If input2 is given, but not analyse_r2,
+ * the read 2 records are only checked and copied, and the duplicates are
+ * detected using read 1 only.
+ *
+ * If there is an error, an error message is printed and valid is set to false.
+ */
+template <typename VALUE>
+class RecordParser {
+
+    FastqReader& input1;
+    FastqReader* input2;
+    const size_t str_start, str_len_per_read;
+    const bool region_sorted, unsorted, split_groups, store_ids, keep_records;
+    // Read 2 sequences are analysed, appended to the read 1 sequences
+    const bool pe_sequence;
+    const int band_height;
+
+    enum ParseResult { PARSED, PARSE_ERROR, NEW_BATCH };
+
+    // The current record, which is loaded but not yet parsed
+    FastqRecord rec1, rec2;
+    size_t start_to_coord_offset;
+    unsigned long num_records = 0;
+
+    // Group (region) counter, incremented every time the prefix of the read
+    // identifier, the string before the x and y coordinates, changes. In
+    // unsorted mode, this must be different from 0, as 0 indicates an unknown
+    // group.
+    int unsorted_mode_group_counter = 0, group = 0;
+    map<string, int> unsorted_mode_group;
+    int prev_y = 0;
+    vector<char> read_id;
+    // Read-ID prefix of each group, indexed by group - 1 (if store_ids)
+    deque<ReadIdPrefix> group_prefix;
+
+    public:
+        bool valid = true, finished = false;
+
+        RecordParser(FastqReader& input1, FastqReader* input2,
+                size_t str_start, size_t str_len_per_read, bool region_sorted, bool unsorted,
+                bool split_groups, bool store_ids, bool keep_records, bool analyse_r2,
+                int band_height)
+            : input1(input1), input2(input2), str_start(str_start),
+                str_len_per_read(str_len_per_read), region_sorted(region_sorted),
+                unsorted(unsorted), split_groups(split_groups), store_ids(store_ids),
+                keep_records(keep_records), pe_sequence(input2 && analyse_r2),
+                band_height(band_height) {
+
+            if (!input1.next(rec1)) {
+                cerr << "ERROR: Unable to read from the input file (read 1)" << endl;
+                valid = false;
+                return;
+            }
+            if (input2) {
+                if (!input2->next(rec2)) {
+                    cerr << "ERROR: Unable to read from the input file (read 2)" << endl;
+                    valid = false;
+                    return;
+                }
+                else if (rec2.header_len != rec1.header_len) {
+                    cerr << "ERROR: Header in read 2 is different from header in read 1: length "
+                         << rec2.header_len << " differs from " << rec1.header_len << "." << endl;
+                    valid = false;
+                    return;
+                }
+            }
+            HeaderFormat hf(string(rec1.header, rec1.header_len));
+            if (!hf.valid) {
+                cerr << "ERROR: Illumina format x/y coordinates not detected" << endl;
+                valid = false;
+                return;
+            }
+            start_to_coord_offset = hf.start_to_coord_offset;
+            read_id.resize(start_to_coord_offset);
+        }
+
+        // Parses records into the batch until it is full, or the input ends
+        void fillBatch(ReadBatch<VALUE>& batch) {
+            batch.clear();
+            while (batch.size < batch.capacity && !finished) {
+                if (split_groups && batch.size > 0 && !unsorted
+                        && memcmp(rec1.header, read_id.data(), start_to_coord_offset) != 0) {
+                    break; // The next record starts a new group
+                }
+                ParseResult result = parseRecord(batch);
+                if (result == PARSE_ERROR) {
+                    valid = false;
+                    return;
+                }
+                else if (result == NEW_BATCH) {
+                    break;
+                }
+                ++num_records;
+                if (!input1.next(rec1)) {
+                    finished = true;
+                    if (input1.format_error) {
+                        cerr << "ERROR: " << input1.error_message << " (read 1)" << endl;
+                        valid = false;
+                    }
+                }
+                else if (input2 && !input2->next(rec2)) {
+                    if (input2->format_error) {
+                        cerr << "ERROR: " << input2->error_message << " (read 2)" << endl;
+                    }
+                    else {
+                        cerr << "ERROR: At index " << num_records << " in files "
+                             << "the read 2 file has fewer records than read 1." << endl;
+                    }
+                    valid = false;
+                    return;
+                }
+            }
+        }
+
+    private:
+
+        // True if the text is a number without sign or leading zeros, which is
+        // written the same way by ReadIdSink. At most 9 digits, to fit in an int.
+        static bool plainNumber(const char* begin, const char* end) {
+            if (end - begin < 1 || end - begin > 9) return false;
+            if (*begin == '0' && end - begin > 1) return false;
+            for (const char* c = begin; c < end; ++c) {
+                if (*c < '0' || *c > '9') return false;
+            }
+            return true;
+        }
+
+        ParseResult parseRecord(ReadBatch<VALUE>& batch) {
+            // Read the coordinates, then ignore the rest of the header line. The
+            // header is not null-terminated, but it is followed by a newline.
+            const char* headerbuf = rec1.header;
+            const char* header_end = rec1.header + rec1.header_len;
+            char* ptr;
+            int x, y;
+            const char* x_start = headerbuf + start_to_coord_offset;
+            x = strtol(x_start, &ptr, 10);
+            if (ptr >= header_end || *ptr != ':') {
+                cerr << "ERROR: Invalid file format detected. All reads must be of the same length, "
+                     << "and the header must be the standard Illumina header." << endl;
+                return PARSE_ERROR;
+            }
+            const char* y_start = ptr + 1;
+            const char* x_end = ptr;
+            y = strtol(y_start, &ptr, 10);
+            if (ptr > header_end || (ptr < header_end && *ptr != ' ')) {
+                cerr << "ERROR: Invalid file format detected. All reads must be of the same length, "
+                     << "and the header must be the standard Illumina header." << endl;
+                return PARSE_ERROR;
+            }
+            if (store_ids && !(plainNumber(x_start, x_end) && plainNumber(y_start, ptr))) {
+                cerr << "ERROR: The coordinates in the header must be plain decimal numbers "
+                     << "for the read-ID output: " << string(headerbuf, rec1.header_len) << endl;
+                return PARSE_ERROR;
+            }
+
+            if (band_height > 0 && batch.size > 0
+                    && y / band_height != batch.y[batch.size-1] / band_height) {
+                return NEW_BATCH; // The record is parsed again for the next batch
+            }
+
+            if (input2) { // Note: check pointer not zero => PE enabled
+                if (rec2.header_len != rec1.header_len) {
+                    cerr << "ERROR: At index " << num_records << " in files "
+                         << "PE read headers do not have the same length: R1 header length is "
+                         << rec1.header_len << " and R2 header length is " << rec2.header_len
+                         << "." << endl;
+                    return PARSE_ERROR;
+                }
+                if (rec2.plus_len != rec1.plus_len) {
+                    cerr << "ERROR: PE reads do not have the same length: mismatch in quality header."
+                         << endl;
+                    return PARSE_ERROR;
+                }
+            }
+
+            if (!unsorted) { // Can we assume the file is sorted?
+                // If header prefix doesn't match the last one, signal "end of group" (tile)
+                if (memcmp(headerbuf, read_id.data(), start_to_coord_offset) != 0) {
+                    group++;
+                    memcpy(read_id.data(), headerbuf, start_to_coord_offset);
+                    prev_y = 0;
+                    if (store_ids) {
+                        group_prefix.push_back(ReadIdPrefix{
+                                string(headerbuf + 1, start_to_coord_offset - 1),
+                                (uint32_t)group_prefix.size()});
+                    }
+                }
+                else if (!region_sorted && y < prev_y) {
+                        cerr << "ERROR: The file is not sorted according to y-coordinate. See "
+                             << "options --region-sorted or --unsorted." << endl;
+                        return PARSE_ERROR;
+                }
+            }
+            else {
+                const string id_str(headerbuf, start_to_coord_offset);
+                map<string, int>::iterator location = unsorted_mode_group.find(id_str);
+                if (location == unsorted_mode_group.end()) {
+                    unsorted_mode_group[id_str] = group = ++unsorted_mode_group_counter; 
+                    if (store_ids) {
+                        group_prefix.push_back(ReadIdPrefix{
+                                string(headerbuf + 1, start_to_coord_offset - 1),
+                                (uint32_t)group_prefix.size()});
+                    }
+                }
+                else {
+                    group = location->second;
+                }
+            }
+            prev_y = y;
+
+            const bool analysed = rec1.seq_len >= str_len_per_read + str_start &&
+                    (!pe_sequence || rec2.seq_len >= str_len_per_read + str_start);
+            if (analysed) {
+                size_t i = batch.size++;
+                batch.group[i] = group;
+                batch.x[i] = x;
+                batch.y[i] = y;
+                char* sequence_buf = batch.sequence[i].char_data;
+                memcpy(sequence_buf, rec1.seq + str_start, str_len_per_read);
+                if (pe_sequence) {
+                    memcpy(sequence_buf + str_len_per_read, rec2.seq + str_start, str_len_per_read);
+                }
+                batch.prefix[i] = store_ids ? &group_prefix[group - 1] : nullptr;
+            }
+            if (keep_records) {
+                batch.addRecord(0, rec1);
+                if (input2) batch.addRecord(1, rec2);
+                batch.record_analysed.push_back(analysed);
+            }
+            return PARSED;
+        }
+};
+
+
+// Configuration of the analysis pipeline. The stage timers are filled in during
+// the analysis. If encode_threads is 0, all stages run in the calling thread.
+// If tile_threads is not 0, the tiles are analysed in parallel by that number of
+// threads. If band_height is also set, the tiles are split into bands of this
+// height in the y direction, which are analysed in parallel. The analysis
+// heads prefetch the hash table prefetch_distance reads ahead.
+// If filtered_output[0] is set, the records which are not duplicates are
+// written to it (read 1), and to filtered_output[1] (read 2, if set). If
+// detect_r1_only is set, only read 1 is used to detect the duplicates. If
+// set_sizes is set, the heads find the sizes of the sets of duplicates.
+struct Pipeline {
+    unsigned int encode_threads = 0, tile_threads = 0;
+    int band_height = 0;
+    size_t queue_depth = 4;
+    unsigned int prefetch_distance = PREFETCH_DISTANCE;
+    ostream* filtered_output[2] = {nullptr, nullptr};
+    bool detect_r1_only = false;
+    bool set_sizes = false;
+    StageTimer parse_timer, analysis_timer, output_timer, filter_timer;
+    vector<StageTimer> encode_timers, tile_timers;
+};
+
+
+/*
+ * Function analysisLoop is called by main program to run the actual analysis.
+ *
+ * The work is done in three stages, which operate on batches of records:
+ *  1. A RecordParser reads the input file(s) and parses the headers.
+ *  2. The sequences are encoded as TwoBitSequence values, and hashed.
+ *  3. The batches are entered into an AnalysisHead.
+ *
+ * The parser runs in its own thread, and there is a configurable number of
+ * encoding threads. The batches are distributed round-robin to the encoding
+ * threads, and collected in the same order by the analysis stage, which runs in
+ * the calling thread. The batches are then returned to the parser for reuse.
+ *
+ * In tile-parallel mode, the analysis stage only dispatches the batches. The
+ * parser splits the batches at tile boundaries, and whole tiles are sent
+ * round-robin to a pool of tile threads, each with its own AnalysisHead. This
+ * gives the same result as a single AnalysisHead, because no duplicates are
+ * detected across tiles in sorted mode. The read-ID output of each tile is
+ * buffered, and written in the original order of the tiles by an output thread.
+ *
+ * With the filtered output, the records of each batch are written after the
+ * batch has been analysed, as the status of a read (duplicate of an earlier
+ * read or not) is known when it is entered. Only the batches in the pipeline
+ * are kept in memory. In tile-parallel mode, the analysed batches are
+ * collected in the original order by a filter output thread.
+ *
+ * The tiles can be further split into y-bands (sorted mode only). The reads
+ * in the last winy pixels of a band are copied to a "halo", which is entered
+ * into the hash table before the next band, without counting them. Each read
+ * is thus compared to all the same preceding reads as in the sequential
+ * analysis. The band height must be at least winy.
+ *
+ * This code is separated into a different function in order to be able to use a 
+ * type parameter (VALUE), so it can call the corresponding AnalysisHead efficiently.
+ * The table engine is also a type parameter (HEAD): AnalysisHead or OpenAnalysisHead,
+ * specialised for the sorting mode and the output. See selectAnalysisLoop.
+ */
+template <typename VALUE, typename HEAD>
+Metrics analysisLoop(
+        const typename HEAD::Sink& sink, ostream& output,
+        size_t hash_bytes, size_t str_start, size_t str_len_per_read,
+        int winx, int winy, bool region_sorted, bool unsorted, bool shrink_table,
+        bool hash_stats, FastqReader& input1, FastqReader* input2, Pipeline& pipeline) {
+
+    typedef ReadBatch<VALUE> Batch;
+    typedef SpscQueue<Batch*> BatchQueue;
+
+    // Messages to the tile threads: a batch, the end of a tile or band (null
+    // batch, end_of_tile set), or the end of the input (null batch). Halo
+    // batches are owned by the message, and deleted after use.
+    struct TileMessage {
+        Batch* batch;
+        bool end_of_tile, halo;
+    };
+    typedef SpscQueue<TileMessage> TileQueue;
+
+    // Messages to the filter output thread, in the original order of the
+    // batches: a batch without reads (only records which are too short), the
+    // index of the tile thread which has the next batch, or the end.
+    struct FilterMessage {
+        Batch* batch;
+        unsigned int tile_thread;
+        bool end;
+    };
+
+    const unsigned int num_encoders = pipeline.encode_threads;
+    const unsigned int num_tile_threads = pipeline.tile_threads;
+
+    const bool filter = pipeline.filtered_output[0] != nullptr;
+    RecordParser<VALUE> parser(input1, input2, str_start, str_len_per_read,
+            region_sorted, unsorted, num_tile_threads > 0, HEAD::Sink::store_ids,
+            filter, !pipeline.detect_r1_only, pipeline.band_height);
+    if (!parser.valid) {
+        return error();
+    }
+
+    cerr << "Started reading FASTQ file..." << endl;
+
+    unsigned long next_report = 1000000;
+    auto reportProgress = [&](unsigned long num_reads) {
+        if (num_reads >= next_report) {
+            cerr << "Analysed " << setw(9) << num_reads << " reads." << endl;
+            next_report = (num_reads / 1000000 + 1) * 1000000;
+        }
+    };
+
+    auto writeFiltered = [&](const Batch& batch) {
+        for (int r=0; r<2; ++r) {
+            if (pipeline.filtered_output[r]) batch.writeFiltered(*pipeline.filtered_output[r], r);
+        }
+    };
+
+    if (num_encoders == 0) {
+        HEAD analysisHead(output, sink, hash_bytes, winx, winy, shrink_table, hash_stats,
+                pipeline.set_sizes, pipeline.prefetch_distance);
+        Batch batch(BATCH_SIZE);
+        do { // Input loop
+            parser.fillBatch(batch);
+            if (!parser.valid) {
+                return error();
+            }
+            batch.encode();
+            analysisHead.enterBatch(batch);
+            if (filter) writeFiltered(batch);
+            reportProgress(analysisHead.metrics.num_reads);
+        } while (!parser.finished);
+        analysisHead.finish();
+        return analysisHead.metrics;
+    }
+
+    // Enough batches to fill all the queues, plus one being worked on by the
+    // parser and one by the analysis stage
+    const bool filter_thread_used = filter && num_tile_threads > 0;
+    const size_t num_batches = (2 * num_encoders + num_tile_threads * (filter_thread_used ? 2 : 1))
+            * pipeline.queue_depth + 2;
+    vector<unique_ptr<Batch>> batches;
+    // Used batches are returned to the parser by the analysis stage (queue 0),
+    // by the tile threads (one queue each), and by the filter output thread
+    vector<unique_ptr<BatchQueue>> free_batches;
+    for (unsigned int i=0; i<1+num_tile_threads+filter_thread_used; ++i) {
+        free_batches.emplace_back(new BatchQueue(num_batches));
+    }
+    for (size_t i=0; i<num_batches; ++i) {
+        batches.emplace_back(new Batch(BATCH_SIZE));
+        free_batches[0]->tryPush(batches.back().get());
+    }
+    vector<unique_ptr<BatchQueue>> encode_in, encode_out;
+    for (unsigned int i=0; i<num_encoders; ++i) {
+        encode_in.emplace_back(new BatchQueue(pipeline.queue_depth));
+        encode_out.emplace_back(new BatchQueue(pipeline.queue_depth));
+    }
+    pipeline.encode_timers.resize(num_encoders);
+
+    // Parser thread. At the end of the input, or on error, a null batch is
+    // sent through each encoder to signal the end.
+    thread parse_thread([&]() {
+        StageTimer& timer = pipeline.parse_timer;
+        timer.start();
+        for (size_t seq = 0; ; ++seq) {
+            Batch* batch;
+            BatchQueue::popAny(free_batches, batch, timer);
+            parser.fillBatch(*batch);
+            if (!parser.valid) {
+                break;
+            }
+            encode_in[seq % num_encoders]->push(batch, timer);
+            if (parser.finished) {
+                break;
+            }
+        }
+        for (unsigned int i=0; i<num_encoders; ++i) {
+            encode_in[i]->push(nullptr, timer);
+        }
+        timer.stop();
+    });
+
+    vector<thread> encode_threads;
+    for (unsigned int i=0; i<num_encoders; ++i) {
+        encode_threads.emplace_back([&, i]() {
+            StageTimer& timer = pipeline.encode_timers[i];
+            timer.start();
+            Batch* batch;
+            do {
+                encode_in[i]->pop(batch, timer);
+                if (batch) {
+                    batch->encode();
+                }
+                encode_out[i]->push(batch, timer);
+            } while (batch);
+            timer.stop();
+        });
+    }
+
+    // Tile threads, and the output thread which writes the output of the tiles
+    // in order. The output of a tile is passed as a string, and a null pointer
+    // signals the end.
+    vector<unique_ptr<HEAD>> heads;
+    vector<unique_ptr<ostringstream>> tile_outputs;
+    vector<unique_ptr<TileQueue>> tile_in;
+    vector<unique_ptr<SpscQueue<string*>>> tile_out;
+    vector<thread> tile_threads;
+    thread output_thread;
+    // Analysed batches from each tile thread, for the filter output thread
+    vector<unique_ptr<BatchQueue>> filtered_batches;
+    SpscQueue<FilterMessage> filter_order(num_batches);
+    thread filter_thread;
+    pipeline.tile_timers.resize(num_tile_threads);
+    for (unsigned int i=0; i<num_tile_threads; ++i) {
+        tile_outputs.emplace_back(new ostringstream());
+        heads.emplace_back(new HEAD(*tile_outputs.back(), sink, hash_bytes, winx, winy,
+                    shrink_table, hash_stats, pipeline.set_sizes, pipeline.prefetch_distance));
+        tile_in.emplace_back(new TileQueue(pipeline.queue_depth));
+        tile_out.emplace_back(new SpscQueue<string*>(pipeline.queue_depth));
+        if (filter) {
+            filtered_batches.emplace_back(new BatchQueue(num_batches));
+        }
+    }
+    for (unsigned int i=0; i<num_tile_threads; ++i) {
+        tile_threads.emplace_back([&, i]() {
+            StageTimer& timer = pipeline.tile_timers[i];
+            timer.start();
+            TileMessage message;
+            while (true) {
+                tile_in[i]->pop(message, timer);
+                if (message.batch && message.halo) {
+                    heads[i]->enterBatch(*message.batch, true);
+                    delete message.batch;
+                }
+                else if (message.batch) {
+                    heads[i]->enterBatch(*message.batch);
+                    if (filter) {
+                        filtered_batches[i]->push(message.batch, timer);
+                    }
+                    else {
+                        free_batches[i+1]->push(message.batch, timer);
+                    }
+                }
+                else if (message.end_of_tile) {
+                    if (HEAD::Sink::writes_output) {
+                        tile_out[i]->push(new string(tile_outputs[i]->str()), timer);
+                        tile_outputs[i]->str(string());
+                    }
+                }
+                else {
+                    tile_out[i]->push(nullptr, timer);
+                    break;
+                }
+            }
+            timer.stop();
+        });
+    }
+    if (num_tile_threads > 0) {
+        output_thread = thread([&]() {
+            StageTimer& timer = pipeline.output_timer;
+            timer.start();
+            for (size_t tile = 0; ; ++tile) {
+                string* tile_output;
+                tile_out[tile % num_tile_threads]->pop(tile_output, timer);
+                if (!tile_output) {
+                    break;
+                }
+                output << *tile_output;
+                delete tile_output;
+            }
+            timer.stop();
+        });
+    }
+    if (filter_thread_used) {
+        filter_thread = thread([&]() {
+            StageTimer& timer = pipeline.filter_timer;
+            timer.start();
+            while (true) {
+                FilterMessage message;
+                filter_order.pop(message, timer);
+                if (message.end) {
+                    break;
+                }
+                Batch* batch = message.batch;
+                if (!batch) {
+                    filtered_batches[message.tile_thread]->pop(batch, timer);
+                }
+                writeFiltered(*batch);
+                free_batches[1 + num_tile_threads]->push(batch, timer);
+            }
+            timer.stop();
+        });
+    }
+
+    unique_ptr<HEAD> analysisHead;
+    if (num_tile_threads == 0) {
+        analysisHead.reset(new HEAD(output, sink, hash_bytes, winx, winy, shrink_table,
+                    hash_stats, pipeline.set_sizes, pipeline.prefetch_distance));
+    }
+    StageTimer& timer = pipeline.analysis_timer;
+    timer.start();
+    // The jobs for the tile threads are tiles, or bands of tiles. The reads are
+    // renumbered with the job number as group, so a tile thread discards the
+    // entries from its previous job.
+    unsigned long num_dispatched = 0;
+    size_t job = 0;
+    int job_group = 0, job_band = 0;
+    const int band_height = pipeline.band_height;
+    vector<Batch*> halo;
+    for (size_t seq = 0; ; ++seq) {
+        Batch* batch;
+        encode_out[seq % num_encoders]->pop(batch, timer);
+        if (!batch) {
+            break;
+        }
+        if (num_tile_threads == 0) {
+            analysisHead->enterBatch(*batch);
+            if (filter) writeFiltered(*batch);
+            reportProgress(analysisHead->metrics.num_reads);
+            free_batches[0]->push(batch, timer);
+        }
+        else if (batch->size == 0) {
+            if (filter && !batch->record_analysed.empty()) {
+                filter_order.push(FilterMessage{batch, 0, false}, timer);
+            }
+            else {
+                free_batches[0]->push(batch, timer);
+            }
+        }
+        else {
+            int band = band_height > 0 ? batch->y[0] / band_height : 0;
+            if (num_dispatched > 0 && (batch->group[0] != job_group || band != job_band)) {
+                tile_in[job % num_tile_threads]->push(TileMessage{nullptr, true, false}, timer);
+                ++job;
+                // Send the halo from the previous band in the same tile first
+                for (Batch* halo_batch : halo) {
+                    if (batch->group[0] == job_group) {
+                        fill(halo_batch->group.begin(), halo_batch->group.end(), job + 1);
+                        tile_in[job % num_tile_threads]->push(
+                                TileMessage{halo_batch, false, true}, timer);
+                    }
+                    else {
+                        delete halo_batch;
+                    }
+                }
+                halo.clear();
+            }
+            job_group = batch->group[0];
+            job_band = band;
+            if (band_height > 0) {
+                const int halo_start = (band + 1) * band_height - winy;
+                for (size_t i=0; i<batch->size; ++i) {
+                    if (batch->y[i] >= halo_start) {
+                        if (halo.empty() || halo.back()->size == halo.back()->capacity) {
+                            halo.push_back(new Batch(BATCH_SIZE));
+                        }
+                        halo.back()->append(*batch, i);
+                    }
+                }
+            }
+            fill(batch->group.begin(), batch->group.begin() + batch->size, job + 1);
+            num_dispatched += batch->size;
+            tile_in[job % num_tile_threads]->push(TileMessage{batch, false, false}, timer);
+            if (filter) {
+                filter_order.push(FilterMessage{nullptr, (unsigned int)(job % num_tile_threads),
+                        false}, timer);
+            }
+            reportProgress(num_dispatched);
+        }
+    }
+    for (Batch* halo_batch : halo) {
+        delete halo_batch;
+    }
+    if (num_dispatched > 0) {
+        tile_in[job % num_tile_threads]->push(TileMessage{nullptr, true, false}, timer);
+    }
+    for (unsigned int i=0; i<num_tile_threads; ++i) {
+        tile_in[i]->push(TileMessage{nullptr, false, false}, timer);
+    }
+    if (filter_thread_used) {
+        filter_order.push(FilterMessage{nullptr, 0, true}, timer);
+    }
+    timer.stop();
+
+    parse_thread.join();
+    for (thread& t : encode_threads) {
+        t.join();
+    }
+    for (thread& t : tile_threads) {
+        t.join();
+    }
+    if (output_thread.joinable()) {
+        output_thread.join();
+    }
+    if (filter_thread.joinable()) {
+        filter_thread.join();
+    }
+
+    if (!parser.valid) {
+        return error();
+    }
+    Metrics metrics;
+    if (analysisHead) {
+        analysisHead->finish();
+        metrics = analysisHead->metrics;
+    }
+    for (unsigned int i=0; i<num_tile_threads; ++i) {
+        heads[i]->finish();
+        metrics += heads[i]->metrics;
+    }
+    return metrics;
+}
+
+/*
+ * The analysis loop is compiled separately for each combination of table engine,
+ * sorting mode and output (sink), so that these options are not checked in the
+ * inner loop. These functions select the one to use, and pass the remaining
+ * arguments on to analysisLoop. Paired-end input only makes a difference to the
+ * parser, which checks it once per record.
+ */
+template <typename VALUE, typename MODE, typename SINK, typename... Args>
+Metrics selectTableEngine(bool open_table, const SINK& sink, Args&&... args) {
+    if (open_table) {
+        return analysisLoop<VALUE, OpenAnalysisHead<VALUE, MODE, SINK>>(
+                sink, std::forward<Args>(args)...);
+    }
+    else {
+        return analysisLoop<VALUE, AnalysisHead<VALUE, MODE, SINK>>(
+                sink, std::forward<Args>(args)...);
+    }
+}
+
+template <typename VALUE, typename MODE, typename... Args>
+Metrics selectSink(bool open_table, bool read_ids, bool binary_pairs, Args&&... args) {
+    if (read_ids) {
+        return selectTableEngine<VALUE, MODE>(open_table, ReadIdSink(binary_pairs),
+                std::forward<Args>(args)...);
+    }
+    else {
+        return selectTableEngine<VALUE, MODE>(open_table, CountingSink(),
+                std::forward<Args>(args)...);
+    }
+}
+
+template <typename VALUE>
+Metrics selectAnalysisLoop(bool open_table, bool read_ids, bool binary_pairs,
+        ostream& output, size_t hash_bytes, size_t str_start, size_t str_len_per_read,
+        int winx, int winy, bool region_sorted, bool unsorted, bool shrink_table,
+        bool hash_stats, FastqReader& input1, FastqReader* input2, Pipeline& pipeline) {
+#define selectSinkArgs open_table, read_ids, binary_pairs, output, hash_bytes, str_start, str_len_per_read,\
+        winx, winy, region_sorted, unsorted, shrink_table, hash_stats, input1, input2, pipeline
+    if (unsorted) {
+        return selectSink<VALUE, UnsortedMode>(selectSinkArgs);
+    }
+    else if (region_sorted) {
+        return selectSink<VALUE, RegionSortedMode>(selectSinkArgs);
+    }
+    else {
+        return selectSink<VALUE, SortedMode>(selectSinkArgs);
+    }
+#undef selectSinkArgs
+}
+
+
+// Explicit instantiation of selectAnalysisLoop for N words of 32 bases, for
+// N from 1 to 10 (see main). The instances are declared extern here, and
+// defined in analysis_loop.cpp.
+#define ANALYSIS_LOOP_INSTANCE(N) template Metrics selectAnalysisLoop<TwoBitSequence<N>>(\
+        bool, bool, bool, ostream&, size_t, size_t, size_t, int, int, bool, bool, bool,\
+        bool, FastqReader&, FastqReader*, Pipeline&)
+
+extern ANALYSIS_LOOP_INSTANCE(1);
+extern ANALYSIS_LOOP_INSTANCE(2);
+extern ANALYSIS_LOOP_INSTANCE(3);
+extern ANALYSIS_LOOP_INSTANCE(4);
+extern ANALYSIS_LOOP_INSTANCE(5);
+extern ANALYSIS_LOOP_INSTANCE(6);
+extern ANALYSIS_LOOP_INSTANCE(7);
+extern ANALYSIS_LOOP_INSTANCE(8);
+extern ANALYSIS_LOOP_INSTANCE(9);
+extern ANALYSIS_LOOP_INSTANCE(10);
+
+#endif // #ifndef ANALYSIS_INCLUDED
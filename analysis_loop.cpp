@@ -0,0 +1,12 @@
+#include "analysis.hpp"
+
+/*
+ * Instances of the analysis loop for strings of SEQUENCE_WORDS*32 bases. The
+ * Makefile compiles this file once for each length, from 1 to 10.
+ */
+
+#ifndef SEQUENCE_WORDS
+#error "SEQUENCE_WORDS must be defined"
+#endif
+
+ANALYSIS_LOOP_INSTANCE(SEQUENCE_WORDS);
@@ -0,0 +1,90 @@
+#ifndef ARENA_INCLUDED
+#define ARENA_INCLUDED
+
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+/*
+ * Memory allocator for the entries in the duplicate hash table.
+ *
+ * Many small objects are created and destroyed for every read, so the
+ * allocator takes memory from the system in large blocks, and can release all
+ * the objects at once when a region (tile) is done. The memory is kept for
+ * reuse in the next region.
+ */
+
+
+// IndexPool:
+// Allocates objects of type T from slabs of 65536 objects, and identifies them
+// by 32-bit indices instead of pointers. The upper bits of the index select the
+// slab. Index 0 is never allocated, and can be used as a null reference.
+// Released objects are put on a free list. T must be trivially destructible,
+// as clear() does not call any destructors.
+template<typename T>
+class IndexPool {
+
+    typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+    static const unsigned int slab_bits = 16;
+    static const uint32_t slab_size = 1u << slab_bits;
+
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+    uint32_t next_index = 1;
+    // The free list is linked through the first bytes of the free slots
+    uint32_t free_list = 0;
+
+    Slot& slot(uint32_t index) {
+        return slabs[index >> slab_bits][index & (slab_size - 1)];
+    }
+
+public:
+    static_assert(sizeof(T) >= sizeof(uint32_t), "Object too small for the free list");
+
+    IndexPool() {}
+    IndexPool(const IndexPool&) = delete;
+
+    // Returns the index of uninitialised memory for one object. At most
+    // 2^32 - 1 objects can be allocated at the same time; after that, 0 is
+    // returned.
+    uint32_t allocate() {
+        if (free_list) {
+            uint32_t index = free_list;
+            memcpy(&free_list, &slot(index), sizeof(uint32_t));
+            return index;
+        }
+        if (next_index == 0) {
+            // All the indices have been used, and next_index has wrapped around
+            return 0;
+        }
+        if ((next_index >> slab_bits) == slabs.size()) {
+            slabs.emplace_back(new Slot[slab_size]);
+        }
+        return next_index++;
+    }
+
+    T& operator[](uint32_t index) {
+        return *reinterpret_cast<T*>(&slot(index));
+    }
+
+    // Address of an object, for prefetching. Returns null for index 0.
+    const void* address(uint32_t index) {
+        return index ? &slot(index) : nullptr;
+    }
+
+    // Returns an object to the free list
+    void release(uint32_t index) {
+        memcpy(&slot(index), &free_list, sizeof(uint32_t));
+        free_list = index;
+    }
+
+    // Releases all objects, but keeps the memory for reuse
+    void clear() {
+        free_list = 0;
+        next_index = 1;
+    }
+};
+
+#endif // #ifndef ARENA_INCLUDED
@@ -0,0 +1,242 @@
+#ifndef FASTQ_READER_INCLUDED
+#define FASTQ_READER_INCLUDED
+
+#include <istream>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fastq_splitter.hpp"
+
+/**
+ * MappedFile
+ *
+ * Read-only memory mapping of a whole file. The kernel is told that the
+ * file is going to be read sequentially, so it can read ahead aggressively.
+ * If the file can't be mapped (e.g. it's a pipe), is_open() returns false
+ * and the caller should fall back to reading it as a stream.
+ */
+class MappedFile {
+
+    int fd = -1;
+    void* map = MAP_FAILED;
+    size_t map_size = 0;
+
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    bool open(const std::string& filename) {
+        close();
+        fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd == -1) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            close();
+            return false;
+        }
+        map_size = st.st_size;
+        map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close();
+            return false;
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        madvise(map, map_size, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    void close() {
+        if (map != MAP_FAILED) munmap(map, map_size);
+        if (fd != -1) ::close(fd);
+        map = MAP_FAILED;
+        fd = -1;
+        map_size = 0;
+    }
+
+    bool is_open() const {
+        return map != MAP_FAILED;
+    }
+
+    const char* data() const {
+        return (const char*)map;
+    }
+
+    size_t size() const {
+        return map_size;
+    }
+
+    // Requests that the given range is read into the page cache in the
+    // background.
+    void willNeed(size_t offset, size_t length) const {
+        if (offset >= map_size) return;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = offset & ~(page - 1);
+        length = std::min(length + (offset - start), map_size - start);
+        madvise((char*)map + start, length, MADV_WILLNEED);
+    }
+};
+
+
+// FastqRecord is a view of a single record in the FastqReader's buffer. The
+// pointers are valid until the reader needs to split a new batch of records,
+// at the earliest on the next call to next(). The lengths of the lines don't
+// include the newline, but record_len includes the final newline, if present.
+struct FastqRecord {
+    const char* header;
+    size_t header_len;
+    const char* seq;
+    size_t seq_len;
+    size_t plus_len;
+    const char* qual;
+    size_t qual_len;
+    size_t record_len;
+};
+
+
+/**
+ * FastqReader
+ *
+ * Splits FASTQ data into records, without copying the lines. The data come
+ * either from a MappedFile, in which case the records point directly into the
+ * mapping, or from an istream, which is read in large blocks into a buffer.
+ * The record boundaries are found in batches by a FastqSplitter.
+ */
+class FastqReader {
+
+    // Read-ahead distance for mapped files
+    const size_t readahead_size = 64*1024*1024;
+    const size_t block_size = 4*1024*1024;
+    const size_t max_batch_records = 4096;
+
+    std::istream* stream = nullptr;
+    const MappedFile* mapped = nullptr;
+
+    std::vector<char> buffer;
+    const char* data;
+    size_t data_end = 0, pos = 0, readahead_pos = 0;
+    bool stream_eof = false, split_error = false;
+
+    FastqSplitter splitter;
+    std::vector<RecordBoundary> batch;
+    const char* batch_base = nullptr;
+    size_t batch_pos = 0;
+
+public:
+    bool format_error = false;
+    std::string error_message;
+
+    FastqReader(const MappedFile& file)
+        : mapped(&file), data(file.data()), data_end(file.size()), stream_eof(true) {
+        file.willNeed(0, readahead_size);
+        readahead_pos = readahead_size / 2;
+    }
+
+    FastqReader(std::istream& input)
+        : stream(&input), buffer(block_size), data(buffer.data()) {
+    }
+
+    // True if there is no more data
+    bool atEnd() {
+        if (batch_pos == batch.size() && pos == data_end && !stream_eof) fill();
+        return batch_pos == batch.size() && pos == data_end;
+    }
+
+    // Returns true if the end of the input was reached without an I/O error
+    bool eof() const {
+        return stream_eof && pos == data_end && batch_pos == batch.size() && !bad();
+    }
+
+    // Stream I/O error
+    bool bad() const {
+        return stream != nullptr && stream->bad();
+    }
+
+    // True if all the records of the current batch have been returned, so the
+    // next call to next() may invalidate them. The records of a batch are
+    // consecutive in memory.
+    bool batchEnd() const {
+        return batch_pos == batch.size();
+    }
+
+    // Gets the next record. Returns false at the end of the input or on error
+    // (check format_error / bad()).
+    bool next(FastqRecord& rec) {
+        if (batch_pos == batch.size() && !splitBatch()) {
+            return false;
+        }
+        const RecordBoundary& b = batch[batch_pos++];
+        rec.header = batch_base + b.header;
+        rec.header_len = b.seq - b.header - 1;
+        rec.seq = batch_base + b.seq;
+        rec.seq_len = b.plus - b.seq - 1;
+        rec.plus_len = b.qual - b.plus - 1;
+        rec.qual = batch_base + b.qual;
+        rec.qual_len = b.qual_end - b.qual;
+        rec.record_len = b.qual_end - b.header + (batch_base + b.qual_end < data + data_end);
+        return true;
+    }
+
+private:
+
+    // Finds the next batch of records in the data, reading more data from the
+    // stream if required. Returns false if there are no more records.
+    bool splitBatch() {
+        batch.clear();
+        batch_pos = 0;
+        while (!split_error) {
+            size_t len = std::min(data_end - pos, (size_t)1024*1024*1024);
+            batch_base = data + pos;
+            pos += splitter.split(batch_base, len, stream_eof && len == data_end - pos,
+                    batch, max_batch_records);
+            split_error = !splitter.error_message.empty();
+            if (mapped && pos > readahead_pos) {
+                mapped->willNeed(readahead_pos + readahead_size / 2, readahead_size / 2);
+                readahead_pos += readahead_size / 2;
+            }
+            if (!batch.empty()) {
+                return true;
+            }
+            else if (stream_eof && !split_error) {
+                if (pos != data_end && !bad()) {
+                    format_error = true;
+                    error_message = "Incomplete FASTQ record at the end of the file";
+                }
+                return false;
+            }
+            else if (!split_error) {
+                fill();
+            }
+        }
+        format_error = true;
+        error_message = splitter.error_message;
+        return false;
+    }
+
+    // Moves unprocessed data to the start of the buffer, and reads more
+    // data from the stream
+    void fill() {
+        size_t remaining = data_end - pos;
+        if (remaining > buffer.size() / 2) {
+            buffer.resize(buffer.size() * 2);
+        }
+        memmove(buffer.data(), buffer.data() + pos, remaining);
+        stream->read(buffer.data() + remaining, buffer.size() - remaining);
+        data = buffer.data();
+        data_end = remaining + stream->gcount();
+        pos = 0;
+        stream_eof = !(*stream);
+    }
+};
+
+#endif // #ifndef FASTQ_READER_INCLUDED
@@ -0,0 +1,177 @@
+#ifndef FASTQ_SPLITTER_INCLUDED
+#define FASTQ_SPLITTER_INCLUDED
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FASTQ_SPLITTER_X86
+#endif
+
+/*
+ * Record splitter for FASTQ data
+ *
+ * The FastqSplitter finds the line boundaries of all records in a large buffer.
+ * The newline characters are located by a vectorised scanner, which produces
+ * a list of newline positions for a window of the buffer at a time. The positions
+ * are then grouped into records of four lines, and the structure of each record
+ * is checked.
+ *
+ * The scanner is selected at run time based on the CPU: AVX2, SSE2, or a
+ * portable version using memchr.
+ */
+
+// Offsets of the start of each line of a record, relative to the start of the
+// buffer passed to FastqSplitter::split(). qual_end is the offset of the
+// newline at the end of the quality line, or the end of the data, if the
+// last line is not terminated.
+struct RecordBoundary {
+    uint32_t header, seq, plus, qual, qual_end;
+};
+
+// Newline scanner function type: Stores the offsets of all newlines in data
+// into positions, and returns the number found. positions must have space
+// for len entries.
+typedef size_t (*NewlineScanner)(const char* data, size_t len, uint32_t* positions);
+
+inline size_t scanNewlinesPortable(const char* data, size_t len, uint32_t* positions) {
+    size_t n = 0;
+    const char* p = data, * end = data + len;
+    while ((p = (const char*)memchr(p, '\n', end - p)) != nullptr) {
+        positions[n++] = p - data;
+        ++p;
+    }
+    return n;
+}
+
+#ifdef FASTQ_SPLITTER_X86
+__attribute__((target("sse2")))
+inline size_t scanNewlinesSSE2(const char* data, size_t len, uint32_t* positions) {
+    size_t n = 0, i = 0;
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        while (mask) {
+            positions[n++] = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len; ++i) {
+        if (data[i] == '\n') positions[n++] = i;
+    }
+    return n;
+}
+
+__attribute__((target("avx2")))
+inline size_t scanNewlinesAVX2(const char* data, size_t len, uint32_t* positions) {
+    size_t n = 0, i = 0;
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 64 <= len; i += 64) {
+        __m256i block1 = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i block2 = _mm256_loadu_si256((const __m256i*)(data + i + 32));
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block1, newline))
+            | ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block2, newline)) << 32);
+        while (mask) {
+            positions[n++] = i + __builtin_ctzll(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len; ++i) {
+        if (data[i] == '\n') positions[n++] = i;
+    }
+    return n;
+}
+#endif
+
+inline NewlineScanner selectNewlineScanner() {
+#ifdef FASTQ_SPLITTER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return scanNewlinesAVX2;
+    if (__builtin_cpu_supports("sse2")) return scanNewlinesSSE2;
+#endif
+    return scanNewlinesPortable;
+}
+
+
+class FastqSplitter {
+
+    // The data are scanned for newlines in windows of this size
+    const size_t window_size = 16*1024;
+
+    NewlineScanner scanner;
+    std::vector<uint32_t> newlines;
+
+public:
+    // Description of the problem, if split() found an invalid record
+    std::string error_message;
+
+    FastqSplitter() : scanner(selectNewlineScanner()), newlines(window_size) {
+    }
+
+    /* Finds up to max_records complete records in data, and stores their
+     * boundaries in out. If at_eof is true, the last line of the data doesn't need
+     * to be terminated by a newline. Returns the number of bytes used by the records
+     * in out; the caller should pass the remaining data again, together with more
+     * data if available. If an invalid record is found, error_message is set, and
+     * the records before it are returned. len must be less than 4 GB. */
+    size_t split(const char* data, size_t len, bool at_eof,
+            std::vector<RecordBoundary>& out, size_t max_records) {
+        out.clear();
+        size_t record_start = 0, scanned = 0;
+        uint32_t line_end[4];
+        int line = 0;
+        while (scanned < len) {
+            size_t window = std::min(len - scanned, window_size);
+            size_t n = scanner(data + scanned, window, newlines.data());
+            for (size_t k=0; k<n; ++k) {
+                line_end[line++] = scanned + newlines[k];
+                if (line == 4) {
+                    if (!addRecord(data, record_start, line_end, out)) {
+                        return record_start;
+                    }
+                    record_start = line_end[3] + 1;
+                    line = 0;
+                    if (out.size() == max_records) {
+                        return record_start;
+                    }
+                }
+            }
+            scanned += window;
+        }
+        if (at_eof && line == 3 && record_start < len) {
+            line_end[3] = len;
+            if (addRecord(data, record_start, line_end, out)) {
+                record_start = len;
+            }
+        }
+        return record_start;
+    }
+
+private:
+
+    bool addRecord(const char* data, uint32_t start, const uint32_t* line_end,
+            std::vector<RecordBoundary>& out) {
+        RecordBoundary b = {start, line_end[0] + 1, line_end[1] + 1, line_end[2] + 1, line_end[3]};
+        if (data[b.header] != '@') {
+            error_message = "Invalid FASTQ record: header line does not start with '@'";
+            return false;
+        }
+        if (data[b.plus] != '+') {
+            error_message = "Invalid FASTQ record: third line does not start with '+'";
+            return false;
+        }
+        if (b.plus - b.seq != b.qual_end + 1 - b.qual) {
+            error_message = "Invalid FASTQ record: sequence and quality have different lengths";
+            return false;
+        }
+        out.push_back(b);
+        return true;
+    }
+};
+
+#endif // #ifndef FASTQ_SPLITTER_INCLUDED
@@ -62,15 +62,18 @@ fi
 
 DIR=$(dirname "$0")
 
+# The output is compressed if the input is compressed, regardless of its name
+if [[ "$r1file" == *.gz ]]
+then
+	supr_args+=(--gzip-output)
+fi
+
+# suprDUPr writes the reads which are not duplicates while analysing the
+# input. Only read 1 is used to identify the duplicates.
 if $single_read
 then
-	$DIR/suprDUPr.read_id ${supr_args[*]} "$r1file" | $DIR/filterfq "$r1file" > "$r1output"
+	$DIR/suprDUPr ${supr_args[*]} --output-r1 "$r1output" "$r1file" >&2
 else
-	read_id_fifo=`mktemp -u`_readidfifo
-	mkfifo $read_id_fifo
-	$DIR/suprDUPr.read_id ${supr_args[*]} "$r1file" | tee $read_id_fifo | $DIR/filterfq "$r1file" > "$r1output" &
-	$DIR/filterfq "$r2file" > "$r2output" < $read_id_fifo &
-	wait
-	rm $read_id_fifo
+	$DIR/suprDUPr ${supr_args[*]} --detect-r1-only --output-r1 "$r1output" \
+		--output-r2 "$r2output" "$r1file" "$r2file" >&2
 fi
-
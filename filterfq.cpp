@@ -1,12 +1,14 @@
 #include <fstream>
 #include <iostream>
-#include <thread>
-#include <queue>
-#include <mutex>
-#include <condition_variable>
+#include <memory>
+#include <cstdlib>
 
-#include <boost/iostreams/filtering_stream.hpp>
-#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/stream.hpp>
+#include "fastq_reader.hpp"
+#include "parallel_gzip_source.hpp"
+#include "output_writer.hpp"
+#include "pair_format.hpp"
+#include "read_id_set.hpp"
 
 /*
  * filterdups.cpp
@@ -31,8 +33,26 @@
  * read ID strings are expected to have the same sorting. Entries in the read ID
  * strings may appear multiple times on consecutive lines.
  *
+ * The binary pair format of suprDUPr.read_id --pair-format binary is also accepted
+ * (detected automatically). The first read of each pair is then matched on the tile
+ * prefix and the integer x and y coordinates, instead of the read-ID string.
+ *
+ * With the option -u (unordered), the read-IDs may be in any order. All the IDs are
+ * then loaded into a ReadIdSet before the FASTQ file is read.
+ *
  * If the input filename ends in .gz, the input and output will be treated as
- * gzip-compressed (but not the read-ID list, which is read from STDIN).
+ * gzip-compressed (but not the read-ID list, which is read from STDIN). The input
+ * is decompressed, and the output compressed in the BGZF format, by THREADS
+ * threads each (option -t, default 4).
+ *
+ * Paired-end data are filtered in one pass, with the options -o OUTPUT_R1 and
+ * -p OUTPUT_R2, and a read 2 input file. The reads are matched on read 1 only, and the
+ * two files are read in lockstep, so the pair is kept or removed together. Each file
+ * has its own decompression and compression threads.
+ *
+ * The records are not copied: the input is split into large batches of records,
+ * and the consecutive records which are kept are written to the output as a single
+ * block.
  *
  *
  * This program was initially a PERL script, but this C++ version may give
@@ -41,63 +61,227 @@
  *
  */
 
-#define MAX_LEN 1024
-#define MAX_QUEUE_SIZE 100
+#define DEFAULT_THREADS 4
+#define GZIP_LEVEL 4
+#define STREAM_BUFFER_SIZE 1024*1024
 
 using namespace std;
 
-mutex mx;
-queue<vector<string>> q;
-std::condition_variable cv;
-bool finished = false, output_error = false;
-
-void writerThread(ostream* output) {
-    bool keep_running = true;
-    while (keep_running) {
-        vector<vector<string>> liness;
-        {
-            std::unique_lock<std::mutex> lk(mx);
-            if (!finished)
-                cv.wait(lk, []{return finished || !q.empty();});
-            if (!q.empty()) {
-                keep_running = true;
-                do {
-                    liness.emplace_back(move(q.front()));
-                    q.pop();
-                }
-                while (!q.empty());
-            }
-            else {
-                keep_running = !finished;
-            }
-            cv.notify_all();
+// Checks if the read-ID in the header is prefix, x and y. Only coordinates
+// without a sign or leading zeros match, as in the output of suprDUPr.read_id.
+bool headerMatches(const FastqRecord& rec, const string& prefix, uint32_t x, uint32_t y) {
+    const char* ptr = rec.header + 1;
+    const char* end = rec.header + rec.header_len;
+    if ((size_t)(end - ptr) < prefix.size() || memcmp(ptr, prefix.data(), prefix.size()) != 0) {
+        return false;
+    }
+    ptr += prefix.size();
+    const uint32_t coords[2] = {x, y};
+    for (int i=0; i<2; ++i) {
+        if (i == 1) {
+            if (ptr == end || *ptr != ':') return false;
+            ++ptr;
         }
-        for_each(liness.begin(), liness.end(), [&](vector<string> lines) {
-            for_each(lines.begin(), lines.end(), [&](string s) { (*output) << s << '\n'; });
-            }); // sorry
-        if (!output) {
-            output_error = true;
-            return;
+        const char* start = ptr;
+        uint64_t value = 0;
+        while (ptr < end && *ptr >= '0' && *ptr <= '9' && ptr - start < 10) {
+            value = value * 10 + (*ptr++ - '0');
+        }
+        if (ptr == start || (*start == '0' && ptr - start > 1) || value != coords[i]) {
+            return false;
         }
     }
+    return ptr == end || *ptr == ' ';
 }
 
+// Length of the read-ID in the header, without the "@" and the comment
+size_t readIdLength(const FastqRecord& rec) {
+    const char* id_end = (const char*)memchr(rec.header, ' ', rec.header_len);
+    return (id_end ? id_end - rec.header : rec.header_len) - 1;
+}
 
-int main(int argc, char* argv[]) {
+// Loads the first read-ID of each line or pair from standard input into the
+// set. Returns false on error.
+bool loadReadIds(ReadIdSet& ids, PairReader* pair_reader) {
+    if (pair_reader) {
+        DuplicatePair pair;
+        while (pair_reader->next(pair)) {
+            ids.insert(pair_reader->prefix(pair.tile), pair.x, pair.y);
+        }
+        if (!pair_reader->valid()) {
+            cerr << "Input error while reading pairs from standard input: "
+                 << pair_reader->error_message << endl;
+            return false;
+        }
+    }
+    else {
+        string data;
+        while (getline(cin, data)) {
+            size_t tab = data.find('\t');
+            ids.insert(data.data(), tab == string::npos ? data.size() : tab);
+        }
+        if (!cin.eof()) {
+            cerr << "Input error while reading IDs from standard input" << endl;
+            return false;
+        }
+    }
+    return true;
+}
 
-    // Main function: Reads arguments and calls analysisLoop
-    if (argc != 2) {
-        cerr << "usage: " << argv[0] << " INPUT_FASTQ_FILE" << endl;
-        return 1;
+bool endsWith(const string& text, const string& ending) {
+    return text.size() >= ending.size()
+        && equal(ending.rbegin(), ending.rend(), text.rbegin());
+}
+
+// Consecutive records which are kept, written as one block
+class RecordRun {
+    ostream& output;
+    const char* start = nullptr;
+    size_t length = 0;
+
+public:
+    RecordRun(ostream& output) : output(output) {}
+
+    void add(const FastqRecord& rec) {
+        if (length > 0 && rec.header != start + length) {
+            flush();
+        }
+        if (length == 0) {
+            start = rec.header;
+        }
+        length += rec.record_len;
+        // The last record of the file may not end in a newline
+        if (rec.header[rec.record_len - 1] != '\n') {
+            flush();
+            output.put('\n');
+        }
+    }
+
+    void flush() {
+        if (length > 0) {
+            output.write(start, length);
+            length = 0;
+        }
+    }
+};
+
+// A FASTQ file to filter, and the output of the records which are kept. The
+// input is decompressed and the output compressed by num_threads threads each,
+// if the input file name ends in .gz (or the output file name, for the output).
+// The output is standard output if the name is empty.
+class FilterFile {
+    ifstream file_input;
+    MappedFile mapped_file;
+    boost::iostreams::stream<parallel_gzip_source> gzstream;
+    unique_ptr<FastqReader> reader;
+
+    ofstream file_output;
+    unique_ptr<OutputWriter> writer;
+    unique_ptr<ostream> output;
+    unique_ptr<RecordRun> run;
+
+public:
+    // Opens the files, and prints an error message on failure
+    bool open(const string& input_name, const string& output_name, unsigned int num_threads) {
+        file_input.open(input_name, ios_base::in | ios_base::binary);
+        if (file_input.fail()) {
+            cerr << "Input file read error: " << input_name << endl;
+            return false;
+        }
+        const bool compressed = endsWith(input_name, ".gz");
+        if (compressed) {
+            gzstream.open(parallel_gzip_source(file_input, num_threads), STREAM_BUFFER_SIZE);
+            reader.reset(new FastqReader(gzstream));
+        }
+        else if (mapped_file.open(input_name)) {
+            reader.reset(new FastqReader(mapped_file));
+        }
+        else {
+            reader.reset(new FastqReader(file_input));
+        }
+        if (!output_name.empty()) {
+            file_output.open(output_name, ios_base::out | ios_base::binary);
+            if (!file_output) {
+                cerr << "Output file write error: " << output_name << endl;
+                return false;
+            }
+        }
+        // The output is written (and compressed) by separate threads. We use a gzip
+        // level of 4, used on many fastq files.
+        const bool compress_output = compressed || endsWith(output_name, ".gz");
+        writer.reset(new OutputWriter(output_name.empty() ? cout : file_output, compress_output,
+                    true, GZIP_LEVEL, compress_output ? num_threads : 0));
+        output.reset(new ostream(writer.get()));
+        run.reset(new RecordRun(*output));
+        return true;
     }
-    string filename(argv[1]);
 
-    istream* input_ptr;
-    ostream* output_ptr;
-    boost::iostreams::filtering_istream in;
-    boost::iostreams::filtering_ostream out;
+    // Gets the next record. The kept records must be written before the
+    // reader moves on to the next batch.
+    bool next(FastqRecord& rec) {
+        if (reader->batchEnd()) {
+            run->flush();
+        }
+        return reader->next(rec);
+    }
 
-    bool valid;
+    bool eof() const {
+        return reader->eof();
+    }
+
+    void keep(const FastqRecord& rec) {
+        run->add(rec);
+    }
+
+    void printInputError() {
+        cerr << "error: Unexpected end of file while reading FASTQ file." << endl;
+        if (reader->format_error) cerr << reader->error_message << endl;
+        else if (gzstream.is_open() && !gzstream->get_error_message().empty())
+            cerr << gzstream->get_error_message() << endl;
+        else cerr << strerror(errno) << endl;
+    }
+
+    // Writes the remaining output. Returns false on error.
+    bool close() {
+        run->flush();
+        return writer->close();
+    }
+};
+
+
+int main(int argc, char* argv[]) {
+
+    // Main function: Reads arguments and runs the filter
+    unsigned int num_threads = DEFAULT_THREADS;
+    bool unordered = false, usage_error = false;
+    string output_names[2];
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+        const string option(argv[arg]);
+        if (option == "-t" && arg + 1 < argc) {
+            num_threads = atoi(argv[++arg]);
+        }
+        else if (option == "-u") {
+            unordered = true;
+        }
+        else if (option == "-o" && arg + 1 < argc) {
+            output_names[0] = argv[++arg];
+        }
+        else if (option == "-p" && arg + 1 < argc) {
+            output_names[1] = argv[++arg];
+        }
+        else {
+            usage_error = true;
+        }
+    }
+    const int num_files = argc - arg;
+    if (usage_error || num_files < 1 || num_files > 2 || num_threads == 0
+            || (num_files == 2) != !output_names[1].empty()) {
+        cerr << "usage: " << argv[0] << " [-t THREADS] [-u] [-o OUTPUT_R1 [-p OUTPUT_R2]] "
+             << "INPUT_FASTQ_FILE [INPUT_R2_FASTQ_FILE]" << endl;
+        return 1;
+    }
+    const bool paired = num_files == 2;
 
     // Disable sync with printf, etc.
     ios_base::sync_with_stdio(false);
@@ -106,38 +290,62 @@ int main(int argc, char* argv[]) {
     // Prevents flushing cout when reading from cin
     cin.tie(nullptr);
 
-    ifstream file_input;
-    file_input.open(filename, ios_base::in | ios_base::binary);
-    if (file_input.fail()) {
-        cerr << "Input file read error" << endl;
-        return 1;
-    }
-    // Enable compression for input and output if file ends in ".gz"
-    const string ending(".gz");
-    if (equal(ending.rbegin(), ending.rend(), filename.rbegin())) {
-        in.push(boost::iostreams::gzip_decompressor());
-        in.push(file_input);
-        input_ptr = &in;
-        // Herw we set a gzip level of 4, used on many fastq files, and a 1 MB buffer
-        out.push(boost::iostreams::gzip_compressor(4, 1024*1024));
-        out.push(cout);
-        output_ptr = &out;
+    FilterFile files[2];
+    for (int r=0; r<num_files; ++r) {
+        if (!files[r].open(argv[arg + r], output_names[r], num_threads)) {
+            return 1;
+        }
     }
-    else {
-        input_ptr = &file_input;
-        output_ptr = &cout;
+
+    // Binary pair input starts with a zero byte, which can't start a read-ID
+    unique_ptr<PairReader> pair_reader;
+    if (cin.peek() == pair_format_magic[0]) {
+        pair_reader.reset(new PairReader(cin));
+        if (!pair_reader->valid()) {
+            cerr << pair_reader->error_message << endl;
+            return 1;
+        }
     }
-    istream & input = *input_ptr;
 
-    thread outputer(writerThread, output_ptr);
+    // In unordered mode, all the read-IDs are loaded before filtering
+    unique_ptr<ReadIdSet> id_set;
+    if (unordered) {
+        id_set.reset(new ReadIdSet());
+        if (!loadReadIds(*id_set, pair_reader.get())) {
+            return 1;
+        }
+    }
 
+    // The reads are filtered based on read 1. Read 2 is read in lockstep, and
+    // kept if read 1 is kept.
     string data, header_tag;
-    bool input_eof = false;
-    while (!output_error && !input_eof) {
-        bool accept_all;
+    DuplicatePair pair{0, 0, 0, 0, 0};
+    bool input_eof = false, accept_all = false, have_pair = false;
+    while (!input_eof) {
+        // The ordered list of IDs is followed, except in unordered mode
+        if (pair_reader && !id_set) {
+            // Remove repeated reads (the first read of consecutive pairs)
+            const DuplicatePair old_pair = pair;
+            bool repeated = true;
+            while (repeated && !accept_all) {
+                if (pair_reader->next(pair)) {
+                    repeated = have_pair && pair.tile == old_pair.tile
+                            && pair.x == old_pair.x && pair.y == old_pair.y;
+                    have_pair = true;
+                }
+                else if (pair_reader->valid()) {
+                    accept_all = true;
+                }
+                else {
+                    cerr << "Input error while reading pairs from standard input: "
+                         << pair_reader->error_message << endl;
+                    return 1;
+                }
+            }
+        }
         string old_header_tag(header_tag);
         // Remove repeated ID strings (these do happen in suprDUPr.read_id)
-        while (header_tag == old_header_tag && !accept_all) {
+        while (!pair_reader && !id_set && header_tag == old_header_tag && !accept_all) {
             if (getline(cin, data)) {
                 accept_all = false;
                 size_t tab = data.find('\t');
@@ -152,46 +360,63 @@ int main(int argc, char* argv[]) {
             }
         }
         bool skippable_read_found = false;
-        while (!output_error && !skippable_read_found && !input_eof) {
-            vector<string> lines(4);
-            for (int i=0; i<4; ++i) {
-                getline(input, lines[i]);
-                if (input.eof() && (lines[0] == "" && i==0)) {
-                    input_eof = true;
-                    break;
-                }
-                else if (!input) {
-                    cerr << "error: Unexpected end of file while reading FASTQ file." << endl;
-                    cerr << strerror(errno) << endl;
+        while (!skippable_read_found && !input_eof) {
+            FastqRecord rec, rec2;
+            if (!files[0].next(rec)) {
+                if (!files[0].eof()) {
+                    files[0].printInputError();
                     return 1;
                 }
+                input_eof = true;
+                break;
             }
-            if (!input_eof) {
-                // Check if header matches one of the skippable IDs from stdin
-                if (!accept_all) {
-                    string test = lines[0].substr(1, lines[0].find(' ')-1);
-                    if (header_tag == test) {
-                        skippable_read_found = true;
-                    }
+            if (paired && !files[1].next(rec2)) {
+                if (files[1].eof()) {
+                    cerr << "error: The read 2 file has fewer records than read 1." << endl;
                 }
-                if (!skippable_read_found) {
-                    unique_lock<mutex> lk(mx);
-                    if (q.size() > MAX_QUEUE_SIZE) {
-                        cv.wait(lk, [] {return q.size() < MAX_QUEUE_SIZE;});
-                    }
-                    q.push(move(lines));
-                    cv.notify_all();
+                else {
+                    files[1].printInputError();
                 }
+                return 1;
+            }
+            // Check if header matches one of the skippable IDs from stdin
+            bool skip = false;
+            if (id_set) {
+                skip = id_set->contains(rec.header + 1, readIdLength(rec));
+            }
+            else if (!accept_all && pair_reader) {
+                skip = headerMatches(rec, pair_reader->prefix(pair.tile), pair.x, pair.y);
+            }
+            else if (!accept_all) {
+                size_t id_len = readIdLength(rec);
+                skip = header_tag.size() == id_len
+                        && memcmp(header_tag.data(), rec.header + 1, id_len) == 0;
+            }
+            if (!skip) {
+                files[0].keep(rec);
+                if (paired) files[1].keep(rec2);
             }
+            // Gets the next ID from the list, except in unordered mode
+            skippable_read_found = skip && !id_set;
         }
     }
-    {
-        lock_guard<mutex> lk(mx);
-        finished = true;
-        cv.notify_all();
+    if (paired) {
+        FastqRecord rec2;
+        if (files[1].next(rec2)) {
+            cerr << "error: The read 2 file has more records than read 1." << endl;
+            return 1;
+        }
+        else if (!files[1].eof()) {
+            files[1].printInputError();
+            return 1;
+        }
+    }
+    for (int r=0; r<num_files; ++r) {
+        if (!files[r].close()) {
+            cerr << "Output write error" << endl;
+            return 1;
+        }
     }
-    outputer.join();
 
     return 0;
 }
-
@@ -0,0 +1,394 @@
+#ifndef OUTPUT_WRITER_INCLUDED
+#define OUTPUT_WRITER_INCLUDED
+
+#include <streambuf>
+#include <ostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+#include "pipeline.hpp"
+
+/*
+ * OutputWriter
+ *
+ * Stream buffer which writes the output to another stream (normally standard
+ * output) in a separate thread. The producer formats the output directly into
+ * a large buffer. When the buffer is full, it is passed to the writer thread
+ * through a queue, and the producer continues with the next free buffer. The
+ * producer only has to wait if all the buffers are waiting to be written.
+ *
+ * If compress is set, the output is compressed as a gzip stream (by the
+ * writer thread), with the given compression level. If threaded is false, the
+ * buffers are written by the producer when they are full.
+ *
+ * If compress_threads is given (and threaded is set), the output is instead
+ * compressed in the BGZF format by that many compression threads. BGZF is a
+ * series of gzip members of at most 64 kB each, so the buffers can be
+ * compressed independently, and it can be read by any gzip reader. The writer
+ * thread writes the compressed buffers in order.
+ *
+ * Only one thread may write to the stream buffer. The wrapped stream must not
+ * be used by others until close() has been called.
+ */
+class OutputWriter : public std::streambuf {
+
+    // Size of each buffer
+    const size_t buffer_size = 1024*1024;
+    // Maximum input size and total size of a BGZF block (as bgzip)
+    const size_t bgzf_input_size = 0xff00;
+    const size_t bgzf_block_size = 0x10000;
+
+    std::ostream& out;
+    const bool compress, threaded, bgzf;
+    const int gzip_level;
+    // Enough buffers to keep all the compression threads busy
+    const size_t num_buffers;
+
+    struct Buffer {
+        std::vector<char> data;
+        size_t size = 0;
+        // BGZF blocks of the data, and whether they are done
+        std::vector<char> compressed;
+        size_t compressed_size = 0;
+        bool done = false;
+    };
+    std::vector<std::unique_ptr<Buffer>> buffers;
+    Buffer* current;
+    // Full buffers are sent to the writer thread, which returns them as free
+    // buffers. A null buffer signals the end.
+    SpscQueue<Buffer*> full_buffers, free_buffers;
+    std::thread writer_thread;
+
+    // The writer thread gives the buffers to the compression threads through
+    // jobs, and waits for the oldest buffer to be done
+    std::vector<std::thread> compress_threads;
+    std::mutex m;
+    std::condition_variable cv_job, cv_done;
+    std::deque<Buffer*> jobs;
+    bool terminate = false;
+
+    z_stream zs;
+    std::vector<char> compressed;
+    bool closed = false;
+    std::atomic<bool> failed{false};
+
+    // Busy / idle time of the writer and compression threads, and the total
+    // time the producer waited for a free buffer
+    StageTimer writer_timer, wait_timer;
+    std::vector<StageTimer> compress_timers;
+
+public:
+
+    OutputWriter(std::ostream& out, bool compress, bool threaded, int gzip_level = 1,
+            unsigned int compress_threads = 0)
+        : out(out), compress(compress), threaded(threaded),
+            bgzf(compress && threaded && compress_threads > 0), gzip_level(gzip_level),
+            num_buffers(std::max<size_t>(8, 2*compress_threads + 2)),
+            full_buffers(num_buffers), free_buffers(num_buffers),
+            compress_timers(bgzf ? compress_threads : 0) {
+        for (size_t i=0; i<(threaded ? num_buffers : 1); ++i) {
+            buffers.emplace_back(new Buffer());
+            buffers.back()->data.resize(buffer_size);
+            if (i > 0) free_buffers.tryPush(buffers.back().get());
+        }
+        current = buffers[0].get();
+        setp(current->data.data(), current->data.data() + buffer_size);
+        if (compress && !bgzf) {
+            zs.zalloc = Z_NULL;
+            zs.zfree = Z_NULL;
+            zs.opaque = Z_NULL;
+            // 15 window bits, +16 for gzip header
+            deflateInit2(&zs, gzip_level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+            compressed.resize(buffer_size);
+        }
+        if (threaded) {
+            writer_thread = std::thread(&OutputWriter::writerLoop, this);
+        }
+        for (size_t i=0; i<compress_timers.size(); ++i) {
+            this->compress_threads.emplace_back(&OutputWriter::compressLoop, this, i);
+        }
+    }
+
+    OutputWriter(const OutputWriter&) = delete;
+
+    ~OutputWriter() {
+        close();
+    }
+
+    // Writes all the remaining output, and stops the threads. Returns false if
+    // the output could not be written.
+    bool close() {
+        if (!closed) {
+            closed = true;
+            submit();
+            if (threaded) {
+                full_buffers.push(nullptr, wait_timer);
+                writer_thread.join();
+            }
+            {
+                std::lock_guard<std::mutex> lock(m);
+                terminate = true;
+            }
+            cv_job.notify_all();
+            for (std::thread& t : compress_threads) {
+                t.join();
+            }
+            if (bgzf) {
+                // Empty BGZF block, which marks the end of the file
+                const char bgzf_eof[28] = {
+                    '\x1f', '\x8b', '\x08', '\x04', 0, 0, 0, 0, 0, '\xff', '\x06', 0, 'B', 'C',
+                    '\x02', 0, '\x1b', 0, '\x03', 0, 0, 0, 0, 0, 0, 0, 0, 0
+                };
+                writeData(bgzf_eof, sizeof(bgzf_eof));
+            }
+            else if (compress) {
+                deflateData(nullptr, 0, Z_FINISH);
+                deflateEnd(&zs);
+            }
+            out.flush();
+            if (!out.good()) failed = true;
+        }
+        return !failed;
+    }
+
+    // Prints the busy and idle time of the writer and compression threads
+    void reportStageTimes(std::ostream& report, const std::string& name) const {
+        if (threaded) {
+            writer_timer.report(report, name);
+        }
+        for (size_t i=0; i<compress_timers.size(); ++i) {
+            compress_timers[i].report(report, name + " compress " + std::to_string(i+1));
+        }
+    }
+
+    // Time the producer has waited for the writer thread
+    StageTimer::clock_duration writeWaitTime() const {
+        return wait_timer.idleTime();
+    }
+
+protected:
+
+    int_type overflow(int_type c) override {
+        if (closed) {
+            return traits_type::eof();
+        }
+        submit();
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        if (!closed) {
+            submit();
+        }
+        return failed ? -1 : 0;
+    }
+
+private:
+
+    // Passes the current buffer on to be written, and starts on a free buffer
+    void submit() {
+        current->size = pptr() - pbase();
+        if (current->size == 0) {
+            return;
+        }
+        if (threaded) {
+            full_buffers.push(current, wait_timer);
+            free_buffers.pop(current, wait_timer);
+        }
+        else {
+            write(*current);
+        }
+        setp(current->data.data(), current->data.data() + buffer_size);
+    }
+
+    void writerLoop() {
+        writer_timer.start();
+        if (bgzf) {
+            bgzfWriterLoop();
+        }
+        else {
+            while (true) {
+                Buffer* buffer;
+                full_buffers.pop(buffer, writer_timer);
+                if (!buffer) {
+                    break;
+                }
+                write(*buffer);
+                free_buffers.push(buffer, writer_timer);
+            }
+        }
+        writer_timer.stop();
+    }
+
+    // Writer thread for BGZF: Passes on new buffers to the compression threads
+    // as soon as they are available, and writes the oldest buffer when it is
+    // done.
+    void bgzfWriterLoop() {
+        std::deque<Buffer*> in_progress;
+        bool end = false;
+        while (!end || !in_progress.empty()) {
+            Buffer* buffer = nullptr;
+            bool have_buffer = false;
+            if (!end) {
+                if (in_progress.empty()) {
+                    full_buffers.pop(buffer, writer_timer);
+                    have_buffer = true;
+                }
+                else {
+                    have_buffer = full_buffers.tryPop(buffer);
+                }
+            }
+            if (have_buffer) {
+                if (buffer) {
+                    {
+                        std::lock_guard<std::mutex> lock(m);
+                        buffer->done = false;
+                        jobs.push_back(buffer);
+                    }
+                    cv_job.notify_one();
+                    in_progress.push_back(buffer);
+                }
+                else {
+                    end = true;
+                }
+                continue;
+            }
+            buffer = in_progress.front();
+            {
+                std::unique_lock<std::mutex> lock(m);
+                // Waits a short time, to also check for new buffers
+                writer_timer.beginIdle();
+                cv_done.wait_for(lock, std::chrono::milliseconds(1), [buffer]{ return buffer->done; });
+                writer_timer.endIdle();
+                if (!buffer->done) {
+                    continue;
+                }
+            }
+            in_progress.pop_front();
+            writeData(buffer->compressed.data(), buffer->compressed_size);
+            buffer->size = 0;
+            free_buffers.push(buffer, writer_timer);
+        }
+    }
+
+    void compressLoop(size_t index) {
+        StageTimer& timer = compress_timers[index];
+        timer.start();
+        z_stream bzs;
+        bzs.zalloc = Z_NULL;
+        bzs.zfree = Z_NULL;
+        bzs.opaque = Z_NULL;
+        // Raw deflate (negative window bits), the gzip header is added for
+        // each block
+        deflateInit2(&bzs, gzip_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+        while (true) {
+            Buffer* buffer;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                timer.beginIdle();
+                cv_job.wait(lock, [this]{ return terminate || !jobs.empty(); });
+                timer.endIdle();
+                if (jobs.empty()) {
+                    break;
+                }
+                buffer = jobs.front();
+                jobs.pop_front();
+            }
+            compressBuffer(bzs, *buffer);
+            {
+                std::lock_guard<std::mutex> lock(m);
+                buffer->done = true;
+            }
+            cv_done.notify_all();
+        }
+        deflateEnd(&bzs);
+        timer.stop();
+    }
+
+    // Compresses the data of a buffer into BGZF blocks
+    void compressBuffer(z_stream& bzs, Buffer& buffer) {
+        const size_t header_size = 18, trailer_size = 8;
+        const unsigned char header[16] = {0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff,
+            0x06, 0, 'B', 'C', 0x02, 0};
+        size_t num_blocks = (buffer.size + bgzf_input_size - 1) / bgzf_input_size;
+        buffer.compressed.resize(num_blocks * bgzf_block_size);
+        buffer.compressed_size = 0;
+        for (size_t start = 0; start < buffer.size; start += bgzf_input_size) {
+            size_t size = std::min(bgzf_input_size, buffer.size - start);
+            unsigned char* data = (unsigned char*)buffer.data.data() + start;
+            unsigned char* block = (unsigned char*)buffer.compressed.data() + buffer.compressed_size;
+            bzs.next_in = data;
+            bzs.avail_in = size;
+            bzs.next_out = block + header_size;
+            bzs.avail_out = bgzf_block_size - header_size - trailer_size;
+            if (deflate(&bzs, Z_FINISH) != Z_STREAM_END) {
+                // Data which does not compress is stored instead (level 0)
+                deflateReset(&bzs);
+                deflateParams(&bzs, 0, Z_DEFAULT_STRATEGY);
+                bzs.next_in = data;
+                bzs.avail_in = size;
+                bzs.next_out = block + header_size;
+                bzs.avail_out = bgzf_block_size - header_size - trailer_size;
+                deflate(&bzs, Z_FINISH);
+                deflateParams(&bzs, gzip_level, Z_DEFAULT_STRATEGY);
+            }
+            size_t block_size = header_size + bzs.total_out + trailer_size;
+            deflateReset(&bzs);
+            memcpy(block, header, sizeof(header));
+            putLittleEndian(block + 16, block_size - 1, 2);
+            unsigned char* trailer = block + block_size - trailer_size;
+            putLittleEndian(trailer, crc32(crc32(0, Z_NULL, 0), data, size), 4);
+            putLittleEndian(trailer + 4, size, 4);
+            buffer.compressed_size += block_size;
+        }
+    }
+
+    static void putLittleEndian(unsigned char* p, unsigned long value, int bytes) {
+        for (int i=0; i<bytes; ++i) {
+            p[i] = (value >> (8*i)) & 0xff;
+        }
+    }
+
+    void write(Buffer& buffer) {
+        if (compress) {
+            deflateData(buffer.data.data(), buffer.size, Z_NO_FLUSH);
+        }
+        else {
+            writeData(buffer.data.data(), buffer.size);
+        }
+        buffer.size = 0;
+    }
+
+    void writeData(const char* data, size_t size) {
+        if (size > 0 && !failed) {
+            out.write(data, size);
+            if (!out.good()) failed = true;
+        }
+    }
+
+    void deflateData(const char* data, size_t size, int flush) {
+        zs.next_in = (Bytef*)data;
+        zs.avail_in = size;
+        do {
+            zs.next_out = (Bytef*)compressed.data();
+            zs.avail_out = compressed.size();
+            deflate(&zs, flush);
+            writeData(compressed.data(), compressed.size() - zs.avail_out);
+        } while (zs.avail_out == 0);
+    }
+};
+
+#endif // #ifndef OUTPUT_WRITER_INCLUDED
@@ -0,0 +1,157 @@
+#ifndef PAIR_FORMAT_INCLUDED
+#define PAIR_FORMAT_INCLUDED
+
+#include <istream>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * Binary format for the duplicate pairs, written by suprDUPr --pair-format binary
+ * and read by filterfq.
+ *
+ * The read-ID of an Illumina read is the tile prefix (instrument:run:flowcell:
+ * lane:tile:) followed by the x and y coordinates, so the pairs are stored as
+ * a tile index and the coordinates, instead of the text. The stream starts
+ * with the 8 bytes of pair_format_magic, followed by records which start with a
+ * tag byte. All numbers are unsigned LEB128 varints (7 bits per byte, least
+ * significant first, high bit set on all but the last byte).
+ *
+ *  'P' index length text   Defines the prefix of tile index (without the "@").
+ *                          Written before the first pair in the tile. An index
+ *                          may be defined again, with the same text. Indices
+ *                          of tiles without pairs are skipped, and an index is
+ *                          at most pair_format_max_prefix (far more tiles than
+ *                          any run has), so the reader's table is bounded.
+ *  'D' index x y x2 y2     A duplicate pair: the read (x, y) is a duplicate of
+ *                          the earlier read (x2, y2) in the same tile. The reads
+ *                          are in the same order as in the text output.
+ *
+ * A pair takes about 10 bytes, instead of about 80 for the text.
+ */
+
+const char pair_format_magic[8] = {'\0', 's', 'u', 'p', 'r', 'D', 'U', 'P'};
+
+const char pair_format_prefix_tag = 'P';
+const char pair_format_pair_tag = 'D';
+const uint32_t pair_format_max_prefix = 1024*1024;
+
+inline void writeVarint(std::streambuf& out, uint64_t value) {
+    char bytes[10];
+    size_t n = 0;
+    while (value >= 0x80) {
+        bytes[n++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[n++] = (char)value;
+    out.sputn(bytes, n);
+}
+
+struct DuplicatePair {
+    uint32_t tile;
+    uint32_t x, y, other_x, other_y;
+};
+
+/*
+ * Reads the binary pair format. The caller checks the first byte of the stream
+ * (0 for the binary format, as the text format starts with a read-ID) before
+ * creating the reader.
+ *
+ * If there is an error, next() returns false and error_message is set.
+ */
+class PairReader {
+
+    std::streambuf& in;
+    // Prefix text of each tile index
+    std::vector<std::string> prefixes;
+
+    // Reads a varint; returns false at the end of the input
+    bool readVarint(uint64_t& value) {
+        value = 0;
+        for (unsigned int shift = 0; shift < 64; shift += 7) {
+            int c = in.sbumpc();
+            if (c == std::char_traits<char>::eof()) {
+                return false;
+            }
+            value |= (uint64_t)(c & 0x7f) << shift;
+            if ((c & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool readNumber(uint32_t& value) {
+        uint64_t v;
+        if (!readVarint(v) || v > UINT32_MAX) {
+            return false;
+        }
+        value = (uint32_t)v;
+        return true;
+    }
+
+public:
+    std::string error_message;
+
+    PairReader(std::istream& input) : in(*input.rdbuf()) {
+        char magic[sizeof(pair_format_magic)];
+        if (in.sgetn(magic, sizeof(magic)) != sizeof(magic)
+                || memcmp(magic, pair_format_magic, sizeof(magic)) != 0) {
+            error_message = "Invalid header in the binary pair input";
+        }
+    }
+
+    bool valid() const {
+        return error_message.empty();
+    }
+
+    // Prefix text of a tile index, which is known to be defined
+    const std::string& prefix(uint32_t tile) const {
+        return prefixes[tile];
+    }
+
+    // Reads the next pair. Returns false at the end of the input, or on error.
+    bool next(DuplicatePair& pair) {
+        if (!valid()) {
+            return false;
+        }
+        while (true) {
+            int tag = in.sbumpc();
+            if (tag == std::char_traits<char>::eof()) {
+                return false;
+            }
+            else if (tag == pair_format_prefix_tag) {
+                uint32_t index, length;
+                if (!readNumber(index) || !readNumber(length) || length > 1024*1024) break;
+                std::string text(length, '\0');
+                if (in.sgetn(&text[0], length) != (std::streamsize)length) break;
+                if (index > pair_format_max_prefix) {
+                    error_message = "Invalid prefix index in the binary pair input";
+                    return false;
+                }
+                if (index >= prefixes.size()) {
+                    prefixes.resize(index + 1);
+                }
+                prefixes[index] = text;
+            }
+            else if (tag == pair_format_pair_tag) {
+                if (!(readNumber(pair.tile) && readNumber(pair.x) && readNumber(pair.y)
+                        && readNumber(pair.other_x) && readNumber(pair.other_y))) break;
+                if (pair.tile >= prefixes.size() || prefixes[pair.tile].empty()) {
+                    error_message = "Undefined tile in the binary pair input";
+                    return false;
+                }
+                return true;
+            }
+            else {
+                break;
+            }
+        }
+        error_message = "Invalid or truncated binary pair input";
+        return false;
+    }
+};
+
+#endif // #ifndef PAIR_FORMAT_INCLUDED
@@ -0,0 +1,501 @@
+#ifndef PARALLEL_GZIP_SOURCE_INCLUDED
+#define PARALLEL_GZIP_SOURCE_INCLUDED
+
+#include <thread>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstring>
+#include <zlib.h>
+#include <boost/iostreams/categories.hpp>
+#include "pipeline.hpp"
+
+/**
+ * parallel_gzip_source
+ *
+ * Implementation of a Device (boost::iostreams) which wraps an istream
+ * containing gzip compressed data, and provides the decompressed data to
+ * the caller of read().
+ *
+ * Two formats are handled:
+ *
+ *  - Block gzip (BGZF), as written by bgzip and many FASTQ producers. The
+ *    file is a series of small gzip members, each of which records its own
+ *    compressed size in a "BC" extra field. A reader thread splits the input
+ *    into chunks of whole blocks, and a pool of worker threads inflates the
+ *    chunks concurrently. Output is always delivered in input order.
+ *  - Plain gzip (one or more members without the BGZF field). This can't be
+ *    split, so a single thread inflates it using zlib directly, with large
+ *    buffers. This avoids the per-call overhead of the gzip_decompressor
+ *    filter chain.
+ *
+ * The format is detected on the first read. If num_threads is 0, all work
+ * is done in the calling thread.
+ *
+ * The time each thread spends working and waiting is recorded, and can be
+ * shown with reportStageTimes().
+ *
+ * Known issue: While the parallel_gzip_source is copy-constructible, copies
+ * are not interchangeable. The threads are started on the first call to
+ * read(), so the device should not be copied after that.
+ */
+
+using namespace std;
+
+class parallel_gzip_source {
+
+    // Compressed input is dispatched to the workers in chunks of about this
+    // many bytes (always whole BGZF blocks).
+    const size_t chunk_input_size = 512*1024;
+    // Output chunk size for plain gzip
+    const size_t plain_chunk_size = 1024*1024;
+
+    enum chunk_state { FREE, PENDING, READY };
+
+    struct chunk {
+        vector<char> compressed;
+        vector<char> data;
+        size_t data_size = 0;
+        chunk_state state = FREE;
+        bool last = false, failed = false;
+    };
+
+    istream& wrapped;
+    unsigned int num_threads;
+
+    condition_variable cv_chunk_free, cv_job, cv_chunk_ready;
+    mutex m;
+    vector<thread> threads;
+    vector<chunk> chunks;
+    deque<size_t> jobs;
+    size_t read_seq = 0, read_ptr = 0;
+    bool started = false, bgzf = false, terminate = false, eof = false;
+    string error_message;
+
+    // Timers for the threads, in the same order as threads, and the total time
+    // the caller of read() has waited for data
+    vector<StageTimer> timers;
+    StageTimer::clock_duration read_wait = StageTimer::clock_duration::zero();
+
+    // Header bytes consumed during format detection, which must be
+    // delivered before any more data from the wrapped stream.
+    vector<char> prefix;
+    size_t prefix_ptr = 0;
+
+    // Inflate state for plain gzip, and for BGZF in single threaded mode
+    z_stream zs;
+    bool zs_initialized = false;
+    vector<char> plain_in;
+    bool plain_member_end = false, plain_input_eof = false;
+
+public:
+    typedef char                         char_type;
+    typedef boost::iostreams::source_tag category;
+
+    parallel_gzip_source(istream& wrapped, unsigned int num_threads)
+        : wrapped(wrapped), num_threads(num_threads) {
+    }
+
+    parallel_gzip_source(const parallel_gzip_source& other)
+        : wrapped(other.wrapped), num_threads(other.num_threads) {}
+
+    ~parallel_gzip_source() {
+        {
+            lock_guard<mutex> lk(m);
+            terminate = true;
+        }
+        cv_chunk_free.notify_all();
+        cv_job.notify_all();
+        for (thread& t : threads) {
+            if (t.joinable()) t.join();
+        }
+        if (zs_initialized) {
+            inflateEnd(&zs);
+        }
+    }
+
+    bool is_bgzf() const {
+        return bgzf;
+    }
+
+    // Description of a decompression error, or empty string
+    const string& get_error_message() const {
+        return error_message;
+    }
+
+    // Prints the busy and idle time of each decompression thread
+    void reportStageTimes(ostream& out, const string& name) {
+        lock_guard<mutex> lk(m);
+        for (size_t i=0; i<timers.size(); ++i) {
+            if (!bgzf) timers[i].report(out, name + " inflate");
+            else if (i == 0) timers[i].report(out, name + " read");
+            else timers[i].report(out, name + " inflate " + to_string(i));
+        }
+    }
+
+    // Time spent in read() waiting for the decompression threads
+    StageTimer::clock_duration readWaitTime() const {
+        return read_wait;
+    }
+
+    // Provide decompressed data to the user of this source
+    streamsize read(char* c, streamsize n) {
+        if (!started) {
+            start();
+        }
+        size_t num_read = 0;
+        while (num_read < (size_t)n) {
+            chunk& ch = chunks[read_seq % chunks.size()];
+            if (threads.empty()) {
+                if (ch.state != READY) fillChunkInline(ch);
+            }
+            else {
+                unique_lock<mutex> lk(m);
+                if (ch.state != READY) {
+                    StageTimer::clock::time_point wait_start = StageTimer::clock::now();
+                    cv_chunk_ready.wait(lk, [&]{return ch.state == READY;});
+                    read_wait += StageTimer::clock::now() - wait_start;
+                }
+            }
+            if (ch.failed) {
+                throw ios_base::failure(error_message);
+            }
+            size_t ncpy = min(n - num_read, ch.data_size - read_ptr);
+            memcpy(c + num_read, ch.data.data() + read_ptr, ncpy);
+            read_ptr += ncpy;
+            num_read += ncpy;
+
+            if (read_ptr == ch.data_size) {
+                if (ch.last) {
+                    eof = true;
+                    break;
+                }
+                // Move on to the next chunk
+                read_ptr = 0;
+                ++read_seq;
+                {
+                    lock_guard<mutex> lk(m);
+                    ch.state = FREE;
+                }
+                cv_chunk_free.notify_all();
+            }
+        }
+        if (num_read == 0 && eof) return -1;
+        else return num_read;
+    }
+
+private:
+
+    void start() {
+        started = true;
+        detectFormat();
+        if (!bgzf || num_threads == 0) {
+            memset(&zs, 0, sizeof(zs));
+            // 15 window bits, +16 for gzip header; negative for raw deflate blocks
+            inflateInit2(&zs, bgzf ? -15 : 15 + 16);
+            zs_initialized = true;
+            plain_in.resize(plain_chunk_size);
+        }
+        if (num_threads == 0) {
+            chunks.resize(1);
+        }
+        else if (bgzf) {
+            chunks.resize(2 * num_threads + 2);
+            timers.resize(num_threads + 1);
+            threads.emplace_back(&parallel_gzip_source::dispatchLoop, this);
+            for (unsigned int i=0; i<num_threads; ++i) {
+                threads.emplace_back(&parallel_gzip_source::inflateWorkerLoop, this, i+1);
+            }
+        }
+        else {
+            chunks.resize(2);
+            timers.resize(1);
+            threads.emplace_back(&parallel_gzip_source::plainInflateLoop, this);
+        }
+    }
+
+    // Reads from the prefix buffer, then from the wrapped stream
+    size_t rawRead(char* buf, size_t n) {
+        size_t num_read = min(n, prefix.size() - prefix_ptr);
+        memcpy(buf, prefix.data() + prefix_ptr, num_read);
+        prefix_ptr += num_read;
+        if (num_read < n && wrapped) {
+            wrapped.read(buf + num_read, n - num_read);
+            num_read += wrapped.gcount();
+        }
+        return num_read;
+    }
+
+    // Check the first gzip header for the BGZF extra field
+    void detectFormat() {
+        prefix.resize(12);
+        wrapped.read(prefix.data(), 12);
+        prefix.resize(wrapped.gcount());
+        if (prefix.size() == 12 && (uint8_t)prefix[0] == 0x1f && (uint8_t)prefix[1] == 0x8b
+                && (prefix[3] & 4)) {
+            size_t xlen = (uint8_t)prefix[10] | ((uint8_t)prefix[11] << 8);
+            prefix.resize(12 + xlen);
+            wrapped.read(prefix.data() + 12, xlen);
+            prefix.resize(12 + wrapped.gcount());
+            bgzf = findBlockSize(prefix.data(), prefix.size()) != 0;
+        }
+    }
+
+    // Returns the BSIZE field of a BGZF header, or 0 if not found. The 12-byte fixed
+    // header and all XLEN bytes of extra fields must be present in the buffer.
+    static size_t findBlockSize(const char* header, size_t len) {
+        if (len < 12 || (uint8_t)header[0] != 0x1f || (uint8_t)header[1] != 0x8b
+                || header[2] != 8 || (header[3] & 4) == 0) {
+            return 0;
+        }
+        size_t xlen = (uint8_t)header[10] | ((uint8_t)header[11] << 8);
+        if (len < 12 + xlen) return 0;
+        for (size_t i=12; i+4<=12+xlen; ) {
+            size_t slen = (uint8_t)header[i+2] | ((uint8_t)header[i+3] << 8);
+            if (header[i] == 'B' && header[i+1] == 'C' && slen == 2 && i+6 <= 12+xlen) {
+                return ((uint8_t)header[i+4] | ((uint8_t)header[i+5] << 8)) + 1;
+            }
+            i += 4 + slen;
+        }
+        return 0;
+    }
+
+    // Marks the chunk as failed. The error is reported when the reader
+    // gets to this chunk.
+    void setError(chunk& ch, const string& message) {
+        {
+            lock_guard<mutex> lk(m);
+            if (error_message.empty()) {
+                error_message = message;
+            }
+            ch.failed = true;
+            ch.state = READY;
+        }
+        cv_chunk_ready.notify_all();
+    }
+
+    // Reads whole BGZF blocks into the chunk's compressed buffer, and sizes the
+    // output buffer using the ISIZE fields. Returns false on error.
+    bool readBlocks(chunk& ch) {
+        ch.compressed.resize(chunk_input_size + 65536);
+        size_t pos = 0, output_size = 0;
+        ch.last = false;
+        while (pos < chunk_input_size) {
+            // Fixed header with XLEN
+            size_t n = rawRead(ch.compressed.data() + pos, 12);
+            if (n == 0) {
+                ch.last = true;
+                break;
+            }
+            if (n == 12) {
+                size_t xlen = (uint8_t)ch.compressed[pos+10] | ((uint8_t)ch.compressed[pos+11] << 8);
+                // A BGZF block of at most 64 kB also holds the 8-byte footer,
+                // so a larger extra field would not fit in the buffer
+                if (12 + xlen + 8 > 65536) {
+                    setError(ch, "Invalid BGZF block header (gzip members must all be BGZF blocks)");
+                    return false;
+                }
+                n += rawRead(ch.compressed.data() + pos + 12, xlen);
+            }
+            size_t block_size = findBlockSize(ch.compressed.data() + pos, n);
+            if (block_size == 0) {
+                setError(ch, "Invalid BGZF block header (gzip members must all be BGZF blocks)");
+                return false;
+            }
+            if (block_size < n + 8 || rawRead(ch.compressed.data() + pos + n, block_size - n)
+                    != block_size - n) {
+                setError(ch, "Unexpected end of BGZF compressed file");
+                return false;
+            }
+            const uint8_t* isize = (const uint8_t*)ch.compressed.data() + pos + block_size - 4;
+            output_size += isize[0] | (isize[1] << 8) | (isize[2] << 16) | ((size_t)isize[3] << 24);
+            pos += block_size;
+        }
+        ch.compressed.resize(pos);
+        ch.data.resize(output_size);
+        ch.data_size = output_size;
+        return true;
+    }
+
+    // Inflates all blocks in the chunk. Uses a raw inflate stream owned by
+    // the calling thread.
+    bool inflateBlocks(chunk& ch, z_stream& bzs) {
+        size_t pos = 0, out_pos = 0;
+        while (pos < ch.compressed.size()) {
+            const char* block = ch.compressed.data() + pos;
+            size_t xlen = (uint8_t)block[10] | ((uint8_t)block[11] << 8);
+            size_t block_size = findBlockSize(block, 12 + xlen);
+            const uint8_t* footer = (const uint8_t*)block + block_size - 8;
+            uint32_t crc = footer[0] | (footer[1] << 8) | (footer[2] << 16) | ((uint32_t)footer[3] << 24);
+            size_t isize = footer[4] | (footer[5] << 8) | (footer[6] << 16) | ((size_t)footer[7] << 24);
+
+            inflateReset(&bzs);
+            bzs.next_in = (Bytef*)block + 12 + xlen;
+            bzs.avail_in = block_size - 12 - xlen - 8;
+            bzs.next_out = (Bytef*)ch.data.data() + out_pos;
+            bzs.avail_out = isize;
+            int ret = inflate(&bzs, Z_FINISH);
+            if (ret != Z_STREAM_END || bzs.avail_out != 0) {
+                setError(ch, "Corrupted BGZF block: inflate failed");
+                return false;
+            }
+            if (crc32(crc32(0, Z_NULL, 0), (Bytef*)ch.data.data() + out_pos, isize) != crc) {
+                setError(ch, "Corrupted BGZF block: CRC mismatch");
+                return false;
+            }
+            out_pos += isize;
+            pos += block_size;
+        }
+        return true;
+    }
+
+    // Inflates plain gzip data into the chunk until it is full, or the
+    // input ends. Supports multiple concatenated members.
+    bool inflatePlain(chunk& ch) {
+        ch.data.resize(plain_chunk_size);
+        zs.next_out = (Bytef*)ch.data.data();
+        zs.avail_out = plain_chunk_size;
+        ch.last = false;
+        while (zs.avail_out > 0) {
+            if (zs.avail_in == 0 && !plain_input_eof) {
+                size_t n = rawRead(plain_in.data(), plain_in.size());
+                plain_input_eof = n == 0;
+                zs.next_in = (Bytef*)plain_in.data();
+                zs.avail_in = n;
+            }
+            if (plain_member_end) {
+                // Only continue with a new member if it has a gzip header
+                if (zs.avail_in == 0 || zs.next_in[0] != 0x1f) {
+                    ch.last = true;
+                    break;
+                }
+                inflateReset(&zs);
+                plain_member_end = false;
+            }
+            if (zs.avail_in == 0) {
+                setError(ch, "Unexpected end of gzip compressed file");
+                return false;
+            }
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            if (ret == Z_STREAM_END) {
+                plain_member_end = true;
+            }
+            else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                setError(ch, string("Error in gzip compressed data: ") +
+                        (zs.msg ? zs.msg : "inflate failed"));
+                return false;
+            }
+        }
+        ch.data_size = plain_chunk_size - zs.avail_out;
+        return true;
+    }
+
+    // Single threaded operation: produce the next chunk in the caller's thread
+    void fillChunkInline(chunk& ch) {
+        if (bgzf) {
+            if (readBlocks(ch)) inflateBlocks(ch, zs);
+        }
+        else {
+            inflatePlain(ch);
+        }
+        ch.state = READY;
+    }
+
+    // Thread function to read BGZF blocks from the wrapped stream, and
+    // queue them for decompression
+    void dispatchLoop() {
+        StageTimer& timer = timers[0];
+        startTimer(timer);
+        for (size_t seq = 0; ; ++seq) {
+            chunk& ch = chunks[seq % chunks.size()];
+            {
+                unique_lock<mutex> lk(m);
+                timer.beginIdle();
+                cv_chunk_free.wait(lk, [&]{return ch.state == FREE || terminate;});
+                timer.endIdle();
+                if (terminate) break;
+            }
+            if (!readBlocks(ch)) break;
+            {
+                lock_guard<mutex> lk(m);
+                ch.state = PENDING;
+                jobs.push_back(seq);
+            }
+            cv_job.notify_one();
+            if (ch.last) break;
+        }
+        stopTimer(timer);
+    }
+
+    // Thread function to decompress queued chunks
+    void inflateWorkerLoop(size_t index) {
+        StageTimer& timer = timers[index];
+        startTimer(timer);
+        z_stream bzs;
+        memset(&bzs, 0, sizeof(bzs));
+        inflateInit2(&bzs, -15);
+        while (true) {
+            size_t seq;
+            {
+                unique_lock<mutex> lk(m);
+                timer.beginIdle();
+                cv_job.wait(lk, [&]{return !jobs.empty() || terminate;});
+                timer.endIdle();
+                if (terminate) break;
+                seq = jobs.front();
+                jobs.pop_front();
+            }
+            chunk& ch = chunks[seq % chunks.size()];
+            if (inflateBlocks(ch, bzs)) {
+                {
+                    lock_guard<mutex> lk(m);
+                    ch.state = READY;
+                }
+                cv_chunk_ready.notify_all();
+            }
+        }
+        inflateEnd(&bzs);
+        stopTimer(timer);
+    }
+
+    // Thread function for plain gzip: read and decompress sequentially
+    void plainInflateLoop() {
+        StageTimer& timer = timers[0];
+        startTimer(timer);
+        for (size_t seq = 0; ; ++seq) {
+            chunk& ch = chunks[seq % chunks.size()];
+            {
+                unique_lock<mutex> lk(m);
+                timer.beginIdle();
+                cv_chunk_free.wait(lk, [&]{return ch.state == FREE || terminate;});
+                timer.endIdle();
+                if (terminate) break;
+            }
+            if (!inflatePlain(ch)) break;
+            {
+                lock_guard<mutex> lk(m);
+                ch.state = READY;
+            }
+            cv_chunk_ready.notify_all();
+            if (ch.last) break;
+        }
+        stopTimer(timer);
+    }
+
+    // The timers are accessed with the mutex held, so they can be reported
+    // while the threads are running
+    void startTimer(StageTimer& timer) {
+        lock_guard<mutex> lk(m);
+        timer.start();
+    }
+
+    void stopTimer(StageTimer& timer) {
+        lock_guard<mutex> lk(m);
+        timer.stop();
+    }
+
+};
+
+#endif // #ifndef PARALLEL_GZIP_SOURCE_INCLUDED
@@ -0,0 +1,193 @@
+#ifndef PIPELINE_INCLUDED
+#define PIPELINE_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <string>
+#include <ostream>
+#include <iomanip>
+
+/*
+ * Building blocks for running the analysis as a pipeline of threads.
+ *
+ * The stages pass pointers to batches of records through bounded single
+ * producer / single consumer queues. Each stage keeps a StageTimer, which
+ * records how much of the time the stage was waiting for the other stages,
+ * so the slowest stage of the pipeline can be identified.
+ */
+
+
+// StageTimer accumulates the time a thread spends waiting (idle), out of the
+// total time from start() to stop(). The rest of the time is busy time.
+class StageTimer {
+
+public:
+    typedef std::chrono::steady_clock clock;
+    typedef clock::duration clock_duration;
+
+private:
+    clock::time_point start_time, stop_time, idle_start;
+    clock::duration idle_time = clock::duration::zero();
+    bool running = false, idle = false;
+
+public:
+
+    void start() {
+        start_time = clock::now();
+        running = true;
+    }
+
+    void stop() {
+        if (idle) endIdle();
+        stop_time = clock::now();
+        running = false;
+    }
+
+    void beginIdle() {
+        idle_start = clock::now();
+        idle = true;
+    }
+
+    void endIdle() {
+        idle_time += clock::now() - idle_start;
+        idle = false;
+    }
+
+    // Adds idle time which was measured elsewhere
+    void addIdle(clock::duration duration) {
+        idle_time += duration;
+    }
+
+    clock::duration idleTime() const {
+        if (idle) return idle_time + (clock::now() - idle_start);
+        else return idle_time;
+    }
+
+    clock::duration totalTime() const {
+        return (running ? clock::now() : stop_time) - start_time;
+    }
+
+    // Prints a line with the stage name, busy and idle time in seconds,
+    // and the percentage of the time the stage was busy.
+    void report(std::ostream& out, const std::string& name) const {
+        typedef std::chrono::duration<double> seconds;
+        double total = seconds(totalTime()).count();
+        double idle_s = seconds(idleTime()).count();
+        out << std::left << std::setw(24) << name << std::right << std::fixed
+            << std::setprecision(3)
+            << std::setw(10) << total - idle_s
+            << std::setw(10) << idle_s
+            << std::setw(8) << std::setprecision(1)
+            << (total > 0 ? 100.0 * (total - idle_s) / total : 0.0) << "%"
+            << std::defaultfloat << std::setprecision(6) << '\n';
+    }
+
+    static void reportHeader(std::ostream& out) {
+        out << std::left << std::setw(24) << "Stage" << std::right
+            << std::setw(10) << "Busy (s)" << std::setw(10) << "Idle (s)"
+            << std::setw(9) << "Busy" << '\n';
+    }
+};
+
+
+// Bounded lock-free queue for one producer thread and one consumer thread.
+// The blocking push() and pop() spin with yield while the queue is full
+// or empty, and count this time as idle time for the calling stage.
+template <typename T>
+class SpscQueue {
+
+    // The indices are padded to a cache line on each side, so that the producer
+    // and the consumer don't write to the same cache line (false sharing), and
+    // neither shares a line with the other members or with neighbouring
+    // objects. Padding is used instead of alignas(64), because operator new
+    // doesn't honour extended alignment before C++17, and the queues are
+    // allocated on the heap.
+    static const size_t cache_line = 64;
+
+    std::vector<T> slots;
+    char pad0[cache_line];
+    // Index of the next item to pop, modified by the consumer
+    std::atomic<size_t> head;
+    char pad1[cache_line - sizeof(std::atomic<size_t>)];
+    // Index of the next free slot, modified by the producer
+    std::atomic<size_t> tail;
+    char pad2[cache_line - sizeof(std::atomic<size_t>)];
+
+    // Backs off when a queue is full or empty. Waits that last a long time
+    // go to sleep, so that a stage which is far ahead doesn't take a core from
+    // the bottleneck stage.
+    static void wait(unsigned int& attempt) {
+        if (++attempt < 1000) {
+            std::this_thread::yield();
+        }
+        else {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+public:
+
+    SpscQueue(size_t capacity) : slots(capacity + 1), head(0), tail(0) {
+    }
+
+    SpscQueue(const SpscQueue&) = delete;
+
+    bool tryPush(const T& item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t next = (t + 1) % slots.size();
+        if (next == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        slots[t] = item;
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = slots[h];
+        head.store((h + 1) % slots.size(), std::memory_order_release);
+        return true;
+    }
+
+    void push(const T& item, StageTimer& timer) {
+        if (tryPush(item)) return;
+        timer.beginIdle();
+        unsigned int attempt = 0;
+        while (!tryPush(item)) wait(attempt);
+        timer.endIdle();
+    }
+
+    void pop(T& item, StageTimer& timer) {
+        if (tryPop(item)) return;
+        timer.beginIdle();
+        unsigned int attempt = 0;
+        while (!tryPop(item)) wait(attempt);
+        timer.endIdle();
+    }
+
+    // Pops an item from the first of the queues that is not empty
+    static void popAny(std::vector<std::unique_ptr<SpscQueue>>& queues, T& item,
+            StageTimer& timer) {
+        for (auto& queue : queues) {
+            if (queue->tryPop(item)) return;
+        }
+        timer.beginIdle();
+        for (unsigned int attempt = 0; ; wait(attempt)) {
+            for (auto& queue : queues) {
+                if (queue->tryPop(item)) {
+                    timer.endIdle();
+                    return;
+                }
+            }
+        }
+    }
+};
+
+#endif // #ifndef PIPELINE_INCLUDED
@@ -0,0 +1,191 @@
+#ifndef READ_ID_SET_INCLUDED
+#define READ_ID_SET_INCLUDED
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * ReadIdSet
+ *
+ * Set of read-IDs, which can be looked up in any order. Used by filterfq when
+ * the read-ID list is not in the same order as the FASTQ file.
+ *
+ * An Illumina read-ID is a tile prefix (instrument:run:flowcell:lane:tile:)
+ * followed by the x and y coordinates. The prefixes are stored once, and each
+ * read-ID is stored as a 64-bit key of the prefix index (16 bits) and the x
+ * and y coordinates (24 bits each), in an open addressing hash table. The
+ * table is kept between 3/8 and 3/4 full, so it takes 10.7-21.3 bytes per
+ * read-ID, and up to about 32 bytes while it is resized (the old and the new
+ * table both exist), instead of about 80 for a set of strings.
+ *
+ * Read-IDs which can't be packed like this (coordinates which are not plain
+ * decimal numbers, or too large, and more than 65535 prefixes) are stored as
+ * strings in a separate set. The same rules are applied to the IDs in the set
+ * and the IDs which are looked up, so they match exactly as the text would.
+ */
+class ReadIdSet {
+
+    static const unsigned int coordinate_bits = 24;
+    static const uint32_t max_prefixes = 0xffff;
+    static const size_t min_table_size = 1024;
+
+    std::unordered_map<std::string, uint32_t> prefixes;
+    // Cache of the last prefix looked up, as the reads of a tile are usually
+    // together. The index is 0 for an unknown prefix.
+    std::string last_prefix;
+    uint32_t last_index = 0;
+
+    // Keys; 0 is an empty slot. Prefix indices start at 1, so a key is
+    // never 0.
+    std::vector<uint64_t> table;
+    size_t num_keys = 0;
+
+    std::unordered_set<std::string> other_ids;
+
+    static size_t hash(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdul;
+        key ^= key >> 33;
+        return key;
+    }
+
+    // Parses a coordinate which is a plain decimal number (no sign or leading
+    // zeros) of at most coordinate_bits bits.
+    static bool parseCoordinate(const char* ptr, const char* end, uint32_t& value) {
+        if (ptr == end || end - ptr > 8 || (*ptr == '0' && end - ptr > 1)) {
+            return false;
+        }
+        value = 0;
+        for (; ptr < end; ++ptr) {
+            if (*ptr < '0' || *ptr > '9') return false;
+            value = value * 10 + (*ptr - '0');
+        }
+        return value < (1u << coordinate_bits);
+    }
+
+    static uint64_t packKey(uint32_t prefix_index, uint32_t x, uint32_t y) {
+        return ((uint64_t)prefix_index << (2*coordinate_bits)) | ((uint64_t)x << coordinate_bits) | y;
+    }
+
+    // Finds the index of a prefix. If add is set, unknown prefixes are added
+    // (up to the maximum number). Returns 0 if the prefix has no index.
+    uint32_t prefixIndex(const char* prefix, size_t prefix_len, bool add) {
+        if (prefix_len == last_prefix.size() && memcmp(prefix, last_prefix.data(), prefix_len) == 0
+                && (last_index != 0 || !add)) {
+            return last_index;
+        }
+        last_prefix.assign(prefix, prefix_len);
+        auto it = prefixes.find(last_prefix);
+        if (it != prefixes.end()) {
+            last_index = it->second;
+        }
+        else if (add && prefixes.size() < max_prefixes) {
+            last_index = prefixes.size() + 1;
+            prefixes.emplace(last_prefix, last_index);
+        }
+        else {
+            last_index = 0;
+        }
+        return last_index;
+    }
+
+    // Splits a read-ID into the prefix and coordinates, and gets the key.
+    // Returns false if it can't be packed.
+    bool packReadId(const char* id, size_t len, bool add, uint64_t& key) {
+        const char* end = id + len;
+        const char* y_colon = (const char*)memrchr(id, ':', len);
+        if (!y_colon) return false;
+        const char* x_colon = (const char*)memrchr(id, ':', y_colon - id);
+        if (!x_colon) return false;
+        uint32_t x, y;
+        if (!parseCoordinate(x_colon + 1, y_colon, x) || !parseCoordinate(y_colon + 1, end, y)) {
+            return false;
+        }
+        uint32_t index = prefixIndex(id, x_colon + 1 - id, add);
+        if (index == 0) return false;
+        key = packKey(index, x, y);
+        return true;
+    }
+
+    // The table is kept at most 3/4 full, with linear probing
+    void insertKey(uint64_t key) {
+        if ((num_keys + 1) * 4 > table.size() * 3) {
+            resize(table.empty() ? min_table_size : table.size() * 2);
+        }
+        size_t mask = table.size() - 1;
+        for (size_t i = hash(key) & mask; ; i = (i + 1) & mask) {
+            if (table[i] == key) {
+                return;
+            }
+            else if (table[i] == 0) {
+                table[i] = key;
+                ++num_keys;
+                return;
+            }
+        }
+    }
+
+    bool containsKey(uint64_t key) const {
+        if (table.empty()) {
+            return false;
+        }
+        size_t mask = table.size() - 1;
+        for (size_t i = hash(key) & mask; table[i] != 0; i = (i + 1) & mask) {
+            if (table[i] == key) return true;
+        }
+        return false;
+    }
+
+    void resize(size_t size) {
+        std::vector<uint64_t> old_table(size, 0);
+        old_table.swap(table);
+        num_keys = 0;
+        for (uint64_t key : old_table) {
+            if (key != 0) insertKey(key);
+        }
+    }
+
+public:
+
+    // Adds a read-ID (without the "@")
+    void insert(const char* id, size_t len) {
+        uint64_t key;
+        if (packReadId(id, len, true, key)) {
+            insertKey(key);
+        }
+        else {
+            other_ids.emplace(id, len);
+        }
+    }
+
+    // Adds a read-ID given as the prefix and the coordinates, as in the
+    // binary pair format
+    void insert(const std::string& prefix, uint32_t x, uint32_t y) {
+        uint32_t index;
+        if (x < (1u << coordinate_bits) && y < (1u << coordinate_bits)
+                && (index = prefixIndex(prefix.data(), prefix.size(), true)) != 0) {
+            insertKey(packKey(index, x, y));
+        }
+        else {
+            other_ids.insert(prefix + std::to_string(x) + ":" + std::to_string(y));
+        }
+    }
+
+    bool contains(const char* id, size_t len) {
+        uint64_t key;
+        if (packReadId(id, len, false, key)) {
+            return containsKey(key);
+        }
+        return !other_ids.empty() && other_ids.count(std::string(id, len)) != 0;
+    }
+
+    size_t size() const {
+        return num_keys + other_ids.size();
+    }
+};
+
+#endif // #ifndef READ_ID_SET_INCLUDED
@@ -0,0 +1,135 @@
+#ifndef SEQUENCE_ENCODER_INCLUDED
+#define SEQUENCE_ENCODER_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SEQUENCE_ENCODER_X86
+#endif
+
+/*
+ * Encoders for the two-bit representation of nucleotide sequences
+ *
+ * Conversion of ASCII string to 2-bit codes + unknown (N) flag:
+ *        vv
+ *  A 1000001
+ *  C 1000011
+ *  G 1000111
+ *  T 1010100
+ *  N 1001110
+ *       ^
+ * So we use a bit mask of 0x06 = 00000110 to fish out the code bits, and
+ * 0x08 for the N flag, and then shift them as appropriate.
+ *
+ * The input of a sequence is N words of 32 characters, each word given as four
+ * 64-bit blocks of 8 characters. The 2-bit codes aren't stored in order,
+ * making it more efficient to combine the blocks. Byte k of data word i holds
+ * the codes of characters k, 8+k, 16+k and 24+k of the word, in that order
+ * from the least significant bits. The N flags of two words are stored in one
+ * unk word: byte k holds the flags of the same four characters of word i, in
+ * bits 0-3 for even i and bits 4-7 for odd i. Zero padding gives the code and
+ * flag 0, like A. The order is irrelevant as long as all the encoders use the
+ * same, as the codes are only compared for equality, and hashed.
+ *
+ * All the encoders produce exactly the same output. The encoder is selected at
+ * run time based on the CPU: AVX2, SSE2, or a portable version. (A version
+ * using the BMI2 PEXT/PDEP instructions was tried, but was slower than the
+ * portable version, as these have to be applied to each block separately.)
+ */
+
+// Sequence encoder function type: Encodes count sequences of N words. The
+// input sequences are back to back in blocks, 4*N blocks each. The output
+// for each sequence is N data words followed by (N+1)/2 unk words, back to
+// back in codes.
+template<size_t N>
+using SequenceEncoder = void (*)(const unsigned long* blocks, unsigned long* codes, size_t count);
+
+template<size_t N>
+inline void encodeSequencesPortable(const unsigned long* blocks, unsigned long* codes, size_t count) {
+    for (size_t r=0; r<count; ++r, blocks += 4*N, codes += N + (N+1)/2) {
+        unsigned long* unk = codes + N;
+        for (size_t i=0; i<N; ++i) {
+            unsigned long data = 0, flags = 0;
+            for (size_t j=0; j<4; ++j) {
+                unsigned long block = blocks[i*4+j];
+                data |= ((block & 0x0606060606060606ul) >> 1) << (j*2);
+                flags |= ((block & 0x0808080808080808ul) >> 3) << (j + 4*(i & 1));
+            }
+            codes[i] = data;
+            if (i & 1) unk[i/2] |= flags;
+            else unk[i/2] = flags;
+        }
+    }
+}
+
+#ifdef SEQUENCE_ENCODER_X86
+// Two blocks are processed in each vector. The first vector has the blocks
+// which need the smaller shifts, so the blocks in the second vector are
+// combined with the first after a shift, and finally the two lanes are
+// combined.
+template<size_t N>
+__attribute__((target("sse2")))
+void encodeSequencesSSE2(const unsigned long* blocks, unsigned long* codes, size_t count) {
+    const __m128i code_mask = _mm_set1_epi8(0x06), flag_mask = _mm_set1_epi8(0x08);
+    for (size_t r=0; r<count; ++r, blocks += 4*N, codes += N + (N+1)/2) {
+        unsigned long* unk = codes + N;
+        for (size_t i=0; i<N; ++i) {
+            __m128i b01 = _mm_loadu_si128((const __m128i*)(blocks + i*4));
+            __m128i b23 = _mm_loadu_si128((const __m128i*)(blocks + i*4 + 2));
+            __m128i data = _mm_or_si128(_mm_srli_epi64(_mm_and_si128(b01, code_mask), 1),
+                    _mm_slli_epi64(_mm_and_si128(b23, code_mask), 3));
+            __m128i flags = _mm_or_si128(_mm_srli_epi64(_mm_and_si128(b01, flag_mask), 3),
+                    _mm_srli_epi64(_mm_and_si128(b23, flag_mask), 1));
+            codes[i] = _mm_cvtsi128_si64(_mm_or_si128(data,
+                        _mm_slli_epi64(_mm_unpackhi_epi64(data, data), 2)));
+            unsigned long f = _mm_cvtsi128_si64(_mm_or_si128(flags,
+                        _mm_slli_epi64(_mm_unpackhi_epi64(flags, flags), 1)));
+            if (i & 1) unk[i/2] |= f << 4;
+            else unk[i/2] = f;
+        }
+    }
+}
+
+// The four blocks of a word are shifted into place by a variable shift, and
+// then the codes and flags are combined across the lanes together.
+template<size_t N>
+__attribute__((target("avx2")))
+void encodeSequencesAVX2(const unsigned long* blocks, unsigned long* codes, size_t count) {
+    const __m256i code_mask = _mm256_set1_epi8(0x06), flag_mask = _mm256_set1_epi8(0x08);
+    const __m256i code_shift = _mm256_setr_epi64x(0, 2, 4, 6);
+    const __m256i flag_shift[2] = {_mm256_setr_epi64x(0, 1, 2, 3), _mm256_setr_epi64x(4, 5, 6, 7)};
+    for (size_t r=0; r<count; ++r, blocks += 4*N, codes += N + (N+1)/2) {
+        unsigned long* unk = codes + N;
+        for (size_t i=0; i<N; ++i) {
+            __m256i b = _mm256_loadu_si256((const __m256i*)(blocks + i*4));
+            __m256i data = _mm256_sllv_epi64(
+                    _mm256_srli_epi64(_mm256_and_si256(b, code_mask), 1), code_shift);
+            __m256i flags = _mm256_sllv_epi64(
+                    _mm256_srli_epi64(_mm256_and_si256(b, flag_mask), 3), flag_shift[i & 1]);
+            // Lanes: data 0|1, flags 0|1, data 2|3, flags 2|3
+            __m256i pairs = _mm256_or_si256(_mm256_unpacklo_epi64(data, flags),
+                    _mm256_unpackhi_epi64(data, flags));
+            __m128i both = _mm_or_si128(_mm256_castsi256_si128(pairs),
+                    _mm256_extracti128_si256(pairs, 1));
+            codes[i] = _mm_cvtsi128_si64(both);
+            unsigned long f = _mm_extract_epi64(both, 1);
+            if (i & 1) unk[i/2] |= f;
+            else unk[i/2] = f;
+        }
+    }
+}
+#endif
+
+template<size_t N>
+inline SequenceEncoder<N> selectSequenceEncoder() {
+#ifdef SEQUENCE_ENCODER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return encodeSequencesAVX2<N>;
+    if (__builtin_cpu_supports("sse2")) return encodeSequencesSSE2<N>;
+#endif
+    return encodeSequencesPortable<N>;
+}
+
+#endif // #ifndef SEQUENCE_ENCODER_INCLUDED
@@ -1,523 +1,82 @@
-#include <utility>
-
-#include <fstream>
-#include <iostream>
-#include <iomanip>
-
-#include <unordered_map>
-#include <forward_list>
-
-#include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/stream.hpp>
 #include <boost/program_options.hpp>
-#include "thread_source.hpp"
-
-// gzip compatibility: gzip from Boost 1.48 does not support block gzip format
-// (bgzf), so we include a local header file with support for it.
-#if BOOST_VERSION == 104800
-#include "gzip.hpp"
-#else
-#include <boost/iostreams/filter/gzip.hpp>
-#endif
+#include "parallel_gzip_source.hpp"
+#include "analysis.hpp"
 
 
 /*
  * suprDUPr - the duplicate detection tool
  *
- * This source file contains the entire suprDUPr program. The main function
- * is located at the bottom of the file.
+ * This source file contains the main program: the options, and opening the
+ * input and output. The analysis is in analysis.hpp.
  *
- * The code can be built in two different ways, depending on the value 
- * of the preprocessor macro named OUTPUT_READ_ID. If this macro is set 
- * to true, the program is modified to output read-identifier strings instead
- * of just counting.
+ * The program either counts the duplicates, or outputs read-identifier
+ * strings of the duplicates (--read-ids). When it is run under the name
+ * suprDUPr.read_id, it always outputs the read-identifiers.
  */
 
-// This constant contains the maximum length of each line in the input file,
-// used for the buffer size.
-#define MAX_LEN 1024
-
 #define STREAM_BUFFER_SIZE 1024*1024
 
-using namespace std;
-namespace po = boost::program_options;
-
-
-// TwoBitSequence:
-// Class to hold a fixed length nucleotide sequence, in an efficient two-bit
-// encoding. It's mainly use for equality comparisons, so it has no method to
-// recover the original string.
-template <size_t N>
-class TwoBitSequence {
- 
-public:
-    // SequenceBuffer type -- Used as a buffer for data input. Can appear as both
-    // a char array and a long array.
-    struct SequenceBuffer {
-        union {
-            unsigned long data[N*4];
-            char char_data[N*4*8];
-        };
-    };
-
-    unsigned long data[N] = {};
-    // Have half the number of unk's for N bases, but round up
-    unsigned long unk[(N+1)/2] = {};
-    
-    inline TwoBitSequence(const unsigned long* blocks) {
-        /* Conversion of ASCII string to 2-bit codes + unknown (N) flag:
-         *        vv
-         *  A 1000001
-         *  C 1000011
-         *  G 1000111
-         *  T 1010100
-         *  N 1001110
-         *
-         * So we use a bit mask of 0x06 = 00000110 to fish out these bits, and
-         * then shift them as appropriate.
-         *
-         * The 2-bit codes aren't stored in order, making it a bit more efficient
-         * to read them in 8-byte chunks. One can fit 4 2-bit base pairs into the
-         * space of a single ASCII character (byte). The data are stored in
-         * an unique, but non-obvious order (order is irrelevant as long as equality
-         * is preserved):
-         * 1,9,17,25,2,10,18,26,3,11,19,27,.....,8,16,24,32
-         *
-         * The sequence length is not needed. It is the responsibility of the 
-         * caller to call the TwoBitSequence<N> with the correct N, where N
-         * is seq_len/32 rounded up. Also, the buffer passed to the constructor
-         * must be at least N*32 bytes long, zero padded if necessary.
-         *
-         * The handling of 'N' characters, i.e. unknown base calls, in addition
-         * to ACGT was added later.
-         */
-        for (size_t i=0; i<N; ++i) {
-            // Read four blocks of ASCII data into the i-th 64-bit int
-            data[i] = (blocks[i*4] & (0x0606060606060606ul)) >> 1;
-            size_t j;
-            for (j=0; j<3; ++j) {
-                data[i] |= (blocks[i*4+j+1] & (0x0606060606060606ul)) << (j*2+1);
-            }
-
-            // Dealing with N characters: every two iterations of this loop share
-            // one entry in the unk array. This adds a different offset for even
-            // and odd iterations.
-            size_t jshift, nshift;
-            j = 0;
-            if ((i & 1) == 1)
-                nshift = 4;
-            else
-                nshift = 0;
-            jshift = nshift;
-            // Load four blocks of Ns into the current unk entry
-            for (; jshift<3; ++jshift) {
-                unk[i/2] |= (blocks[i*4+(j++)] & (0x0808080808080808ul)) >> (3-jshift);
-            }
-            for (; jshift<4+nshift; ++jshift) {
-                unk[i/2] |= (blocks[i*4+(j++)] & (0x0808080808080808ul)) << (jshift-3);
-            }
-        }
-    }
-
-    inline bool operator==(const TwoBitSequence& other) const {
-        for (size_t i=0; i<N; ++i) {
-            if (data[i] != other.data[i]) 
-                return false;
-        }
-        for (size_t i=0; i<(N+1)/2; ++i) {
-            if (unk[i] != other.unk[i])
-                return false;
-        }
-        return true;
-    }
-
-    // Computes a simple, fast hash of the sequence.
-    inline size_t hash() const {
-        // Hash ignores unk; treats N as G. As N is uncommon, it's 
-        // not worth the effort.
-        size_t hash = 0;
-        for (size_t i=0; i<N; ++i) {
-            hash += data[i];
-        }
-        return hash;
-    }
-};
-
-
-// Entry:
-// This class represents a single sequence read at a specific position 
-// inside a physical region (tile). It holds the coordinates and the 
-// sequence, and in case of the read-ID mode, it holds the read-ID 
-// (FASTQ header) string.
-template<typename VALUE>
-class Entry {
-    public:
-        Entry* next = nullptr;
-        short group;
-        int x, y;
-        VALUE value;
-#ifdef OUTPUT_READ_ID
-        string id;
-
-        Entry(short group, int x, int y, const char* id, size_t idlen, const unsigned long* seq) :
-            group(group), x(x), y(y), value(seq), id(id, idlen) {
-        }
-#else
-        Entry(short group, int x, int y, const unsigned long* seq) :
-            group(group), x(x), y(y), value(seq) {
-        }
-#endif
-
-};
-
-// Metrics is used to pass results from the analysisLoop function back
-// into the main program.
-class Metrics {
-    // Collects totals
-    public:
-        bool error = false;
-        unsigned long reads_with_duplicates = 0;
-        unsigned long num_reads = 0;
-};
-
-/* The AnalysisHead class receives read one by one from the analysis loop,
- * and manages the processing of rows, and groups (tiles). The enterPoint
- * function is the critical piece of code, which checks for duplicates. */
-template<typename VALUE>
-class AnalysisHead {
-
-    ostream& outout;
-
-    const size_t hash_size;
-    const size_t mask;
-    int winx, winy;
-    const bool region_sorted, unsorted;
-    size_t str_len;
-
-    typedef Entry<VALUE> Ent;
-    Ent** data = nullptr;
-
-    public:
-    Metrics metrics;
-        
-        AnalysisHead(ostream& outout, 
-                size_t hash_bytes, unsigned int winx, unsigned int winy, bool region_sorted,
-                bool unsorted)
-            : outout(outout),
-                hash_size(hash_bytes/sizeof(Ent*)), mask(hash_size-1),
-                winx(winx), winy(winy), region_sorted(region_sorted), unsorted(unsorted) {
-            data = new Ent*[hash_size];
-        }
-
-        ~AnalysisHead() {
-            delete data;
-        }
-
-#ifdef OUTPUT_READ_ID
-        void enterPoint(int group, int x, int y, const char* id, size_t idlen, const unsigned long* seq) {
-            Ent* new_entry = new Ent(group,x,y,id,idlen,seq);
-#else
-        void enterPoint(int group, int x, int y, const unsigned long* seq) {
-            Ent* new_entry = new Ent(group,x,y,seq);
-#endif
-            Ent** entry_ptr = &data[new_entry->value.hash() & mask];
-            bool any_duplicate_found = false;
-            while (*entry_ptr) {
-                Ent* entry = (*entry_ptr);
-                if ((y - entry->y) > winy) {
-                    if (unsorted || region_sorted) {
-                        entry_ptr = &entry->next;
-                        continue;
-                    }
-                    *entry_ptr = entry->next;
-                    delete entry;
-                }
-                else if (entry->group != group) {
-                    if (unsorted) {
-                        entry_ptr = &entry->next;
-                        continue;
-                    }
-                    *entry_ptr = entry->next;
-                    delete entry;
-                }
-                else {
-#ifdef OUTPUT_READ_ID
-                    // Code path to output the read-ID, can be enabled at compile time.
-                    if (abs(entry->x - x) < winx
-                        && entry->value == new_entry->value) {
-                        any_duplicate_found = true;
-                        outout << new_entry->id << '\t' << entry->id << '\n';
-                    }
-#else
-                    // This is a more optimised version, which breaks out of the loop
-                    // on the first match, to work better on files with high duplication
-                    // ratio.
-                    if (any_duplicate_found == 0
-                            && abs(entry->x - x) < winx
-                            && entry->value == new_entry->value) {
-                        any_duplicate_found = 1;
-                        (new_entry)->next = entry;
-                        break;
-                    }
-#endif
-                    entry_ptr = &entry->next;
-                }
-            }
-            if (any_duplicate_found) {
-                metrics.reads_with_duplicates++;
-            }
-            metrics.num_reads++;
-            *entry_ptr = new_entry;
-        }
-};
-
-int get_coordinate_position() {
-    return 0;
-};
-
-
-// This returns a result signifying an error.
-Metrics error() {
-    Metrics m;
-    m.error = true;
-    return m;
-}
-
-
-class HeaderFormat {
-
-public:
-    bool valid;
-    size_t start_to_coord_offset = 0;
-    HeaderFormat(const string& header) {
-
-        // Determine the header format. In Illumina format, the x coordinate
-        // is after the fifth colon and the y coordinate after the sixth 
-        // colon up to a space.
-        size_t start_to_y_coord_offset = 0;
-        size_t colons = 0, end_coords = 0; // temporary variables
-        size_t i;
-        for (i=0; i<header.size(); ++i) {
-            if (header[i] == ':') {
-                ++colons;
-                if (colons == 5) start_to_coord_offset = i+1;
-                if (colons == 6) start_to_y_coord_offset = i+1;
-            }
-            else if (header[i] == ' ') {
-                end_coords = i;
-            }
-        }
-        if (end_coords == 0)
-            end_coords = i;
-        valid = (colons >= 6);
-    }
-
-    bool operator ==(const HeaderFormat& other) {
-        return start_to_coord_offset == other.start_to_coord_offset &&
-                valid == other.valid;
-     }
-};
-
-long readLineGetCount(istream& stream, char* buffer, size_t max_size) {
-    stream.getline(buffer, max_size);
-    if (stream) {
-        return stream.gcount();
-    }
-    else {
-        return -1;
-    }
-}
-
-
-/*
- * Function analysisLoop is called by main program to run the actual analysis.
- *
- * It reads the input file one record at a time, but hands off the parsed 
- * records to an AnalysisHead object.
- *
- * This code is separated into a different function in order to be able to use a 
- * type parameter (VALUE), so it can call the corresponding AnalysisHead efficiently.
- */
-template <typename VALUE>
-Metrics analysisLoop(
-        ostream& output,
-        size_t hash_bytes, size_t str_start, size_t str_len_per_read,
-        int winx, int winy, bool region_sorted, bool unsorted,
-        istream& input1, istream* input2) {
-
-    char* headerbuf = new char[MAX_LEN];
-    char* dummybuf = new char[MAX_LEN];
-
-    long header_len = readLineGetCount(input1, headerbuf, MAX_LEN);
-    if (header_len == -1) {
-        cerr << "ERROR: Unable to read from the input file (read 1)" << endl;
-        return error();
-    }
-    if (input2) {
-        long header_r2_len = readLineGetCount(*input2, dummybuf, MAX_LEN);
-        if (header_r2_len == -1) {
-            cerr << "ERROR: Unable to read from the input file (read 2)" << endl;
-            return error();
-        }
-        else if (header_r2_len != header_len) {
-            cerr << "ERROR: Header in read 2 is different from header in read 1: length "
-                 << header_r2_len << " differs from " << header_len << "." << endl;
-            return error();
-        }
-    }
-    HeaderFormat hf(string(headerbuf, header_len));
-    if (!hf.valid) {
-        cerr << "ERROR: Illumina format x/y coordinates not detected" << endl;
-        return error();
-    }
-
-    // Group (region) counter, incremented every time the prefix of the read
-    // identifier, the string before the x and y coordinates, changes. In
-    // unsorted mode, this must be different from 0, as 0 indicates an unknown
-    // group.
-    int unsorted_mode_group_counter = 0, group = 0;
-    map<string, int> unsorted_mode_group;
-    int x, y, prev_y = 0;
-
-    // Sequence buffer
-    typename VALUE::SequenceBuffer sequence_buf;
-    memset(&sequence_buf, 0, sizeof(sequence_buf));
-    // Pointer to read sequence data
-    char* databuffer1 = new char[MAX_LEN];
-    char* databuffer2 = new char[MAX_LEN];
-
-    char read_id[hf.start_to_coord_offset];
-    memset(read_id, 0, sizeof(read_id));
-
-    AnalysisHead<VALUE> analysisHead(output, hash_bytes, winx, winy, region_sorted, unsorted);
-
-    cerr << "Started reading FASTQ file..." << endl;
-
-    bool first = true;
-
-    while (input1) { // Input loop
-
-        if (!first)
-            header_len = readLineGetCount(input1, headerbuf, MAX_LEN);
-
-        if (!input1) break;
-
-        // Read the coordinates, then ignore the rest of the header line
-        char* ptr;
-        x = strtol(headerbuf+hf.start_to_coord_offset, &ptr, 10);
-        if (*ptr != ':') {
-            cerr << "ERROR: Invalid file format detected. All reads must be of the same length, "
-                 << "and the header must be the standard Illumina header." << endl;
-            return error();
-        }
-        y = strtol(ptr+1, &ptr, 10);
-        if (*ptr != ' ' && *ptr != '\0') {
-            cerr << "ERROR: Invalid file format detected. All reads must be of the same length, "
-                 << "and the header must be the standard Illumina header." << endl;
-            return error();
-        }
-
-        // Read sequence string, get number of characters read including end of line
-        size_t num_read = readLineGetCount(input1, databuffer1, MAX_LEN);
-
-        // Ignore the quality header and quality, to the end of the record
-        size_t num_qheader = readLineGetCount(input1, dummybuf, MAX_LEN);
-        input1.ignore(num_read);
-        // Setting number read for R2 to something acceptable, in case of single-read, we're
-        // not going to read from input2.
-        long r2_num_read;
-
-        if (input2) { // Note: check pointer not zero => PE enabled
-            long test = 0;
-            if (!first && (test=readLineGetCount(*input2, dummybuf, MAX_LEN)) != header_len) {
-                cerr << "ERROR: At index " << analysisHead.metrics.num_reads << " in files "
-                     << "PE read headers do not have the same length: R1 header length is "
-                     << header_len << " and R2 header length is " << test << "." << endl;
-                return error();
-            }
-            r2_num_read=readLineGetCount(*input2, databuffer2, MAX_LEN);
-            if (readLineGetCount(*input2, dummybuf, MAX_LEN) != num_qheader) {
-                cerr << "ERROR: PE reads do not have the same length: mismatch in quality header."
-                     << endl;
-                return error();
-            }
-            input2->ignore(r2_num_read);
-        }
-
-        if (!unsorted) { // Can we assume the file is sorted?
-            // If header prefix doesn't match the last one, signal "end of group" (tile)
-            if (memcmp(headerbuf, read_id, hf.start_to_coord_offset) != 0) {
-                group++;
-                memcpy(read_id, headerbuf, hf.start_to_coord_offset);
-                prev_y = 0;
-            }
-            else if (!region_sorted && y < prev_y) {
-                    cerr << "ERROR: The file is not sorted according to y-coordinate. See "
-                         << "options --region-sorted or --unsorted." << endl;
-                    return error();
-            }
-        }
-        else {
-            const string id_str(headerbuf, hf.start_to_coord_offset);
-            map<string, int>::iterator location = unsorted_mode_group.find(id_str);
-            if (location == unsorted_mode_group.end()) {
-                unsorted_mode_group[id_str] = group = ++unsorted_mode_group_counter; 
-            }
-            else {
-                group = location->second;
-            }
-        }
-        prev_y = y;
-
-        if (num_read >= 1 + str_len_per_read + str_start && 
-                ((input2 == nullptr) || r2_num_read >= 1 + str_len_per_read + str_start)) {
-            for (int i=0; i<str_len_per_read; ++i) sequence_buf.char_data[i] = databuffer1[i+str_start];
-            if (input2) {
-                for (int i=0; i<str_len_per_read; ++i)
-                    sequence_buf.char_data[i+str_len_per_read] = databuffer2[i+str_start];
-            }
-
-#ifdef OUTPUT_READ_ID
-            size_t id_len = ptr - headerbuf - 1;
-            analysisHead.enterPoint(group, x, y, headerbuf + 1, id_len, sequence_buf.data);
-#else
-            analysisHead.enterPoint(group, x, y, sequence_buf.data);
-#endif
-        }
-
-        first = false;
+// Compression level of the filtered FASTQ output (as filterfq)
+#define FILTER_GZIP_LEVEL 4
 
-        if (analysisHead.metrics.num_reads % 1000000 == 0)
-            cerr << "Analysed " << setw(9) << analysisHead.metrics.num_reads
-                << " reads." << endl;
-    }
-    return analysisHead.metrics;
-}
+namespace po = boost::program_options;
 
 
 // -- Main program and housekeeping code below --
 // Input paramters, opening I/O streams, etc.
 
+bool endsWith(const string& str, const string& suffix) {
+    return str.size() >= suffix.size() &&
+        str.compare(str.size() - suffix.size(), string::npos, suffix) == 0;
+}
+
 void printUsage(const char* program_name) {
     cerr << "usage: " << program_name << " [options] input_file_r1 [input_file_r2] \n";
 }
 
 class InputSelector {
     // InputSelector class sets up the input stream from STDIN, or opens a file,
-    // and detects whether the input is GZIP compressed.
+    // and detects whether the input is GZIP compressed. Compressed input is
+    // decompressed by num_threads worker threads (BGZF), or a single thread (plain
+    // gzip). If num_threads is 0, decompression is done in the analysis thread.
+    // Uncompressed files are memory mapped when possible.
     private:
-        istream* raw_input, *input_ptr;
-        unique_ptr<istream> filtered_input;
+        istream* raw_input;
         ifstream file_input;
-        boost::iostreams::filtering_istream in;
-        boost::iostreams::stream<thread_source> tsstream;
+        boost::iostreams::stream<parallel_gzip_source> gzstream;
+        MappedFile mapped_file;
+        unique_ptr<FastqReader> fastq_reader;
 
     public:
         istream* input;
+        FastqReader* reader;
         bool valid;
 
-        InputSelector(const string& filename, bool multithreading)
-            : tsstream(thread_source(in, STREAM_BUFFER_SIZE), STREAM_BUFFER_SIZE) {
+        // Prints the busy and idle time of the decompression threads, if any
+        void reportStageTimes(ostream& out, const string& name) {
+            if (gzstream.is_open()) {
+                gzstream->reportStageTimes(out, name);
+            }
+        }
+
+        // Time spent by the reader waiting for decompressed data
+        StageTimer::clock_duration readWaitTime() {
+            if (gzstream.is_open()) {
+                return gzstream->readWaitTime();
+            }
+            return StageTimer::clock_duration::zero();
+        }
+
+        // Describes the reason for a failure on the input stream
+        string errorMessage() {
+            if (gzstream.is_open() && !gzstream->get_error_message().empty()) {
+                return gzstream->get_error_message();
+            }
+            return strerror(errno);
+        }
+
+        InputSelector(const string& filename, unsigned int num_threads) {
             // Disable sync with printf, etc.
             ios_base::sync_with_stdio(false);
             // Use a simple locale, for speed
@@ -545,18 +104,15 @@ class InputSelector {
                 raw_input->putback(byte1);
 
                 if (byte1 == 0x1f && byte2 == 0x8b) {
-                    in.push(boost::iostreams::gzip_decompressor());
-                    in.push(*raw_input);
-                    if (multithreading) {
-                        tsstream->start();
-                        input = &tsstream;
-                    }
-                    else {
-                        input = &in;
-                    }
+                    gzstream.open(parallel_gzip_source(*raw_input, num_threads),
+                            STREAM_BUFFER_SIZE);
+                    input = &gzstream;
                 }
                 else {
                     input = raw_input;
+                    if (filename != "-") {
+                        mapped_file.open(filename);
+                    }
                 }
                 valid = true;            
             }
@@ -569,6 +125,15 @@ class InputSelector {
                     valid = false;
                 }
             }
+            if (valid) {
+                if (mapped_file.is_open()) {
+                    fastq_reader.reset(new FastqReader(mapped_file));
+                }
+                else {
+                    fastq_reader.reset(new FastqReader(*input));
+                }
+                reader = fastq_reader.get();
+            }
         }
 };
 
@@ -576,11 +141,13 @@ int main(int argc, char* argv[]) {
 
     // Main function: Reads arguments and calls analysisLoop
     
-    string inputfile1, inputfile2;
-    unsigned int winx, winy;
+    string inputfile1, inputfile2, table_engine, pair_format, output_r1, output_r2;
+    unsigned int winx, winy, num_threads;
     int first_base, last_base = -1;
     size_t hash_bytes;
-    bool region_sorted, unsorted, single_thread, empty_file = false;
+    bool region_sorted, unsorted, single_thread, stage_times, shrink_table,
+         hash_stats, read_ids, gzip_output, detect_r1_only, empty_file = false;
+    Pipeline pipeline;
 
     po::options_description visible("Allowed options");
     visible.add_options()
@@ -592,15 +159,70 @@ int main(int argc, char* argv[]) {
             "First position in reads to consider")
         ("end,e", po::value<int>(&last_base)->default_value(60), 
             "Last position in reads to consider")
-        ("region-sorted,r", po::bool_switch(&single_thread),
+        ("region-sorted,r", po::bool_switch(&region_sorted),
             "Assume the input file is sorted by region (tile), but not by (y, x) coordinate "
             "within the region.")
         ("unsorted,u", po::bool_switch(&unsorted),
-            "Process unsorted file (a large hash-size is recommended, see --hash-size). This "
-            "mode requires all data to be stored in memory, and it is not well optimised.")
+            "Process unsorted file. This mode requires all data to be stored in memory, and "
+            "it is not well optimised.")
+        ("read-ids", po::bool_switch(&read_ids),
+            "Output the read-IDs of the duplicates to standard output, instead of the "
+            "statistics (which are written to standard error). This is the default for "
+            "suprDUPr.read_id.")
+        ("pair-format", po::value<string>(&pair_format)->default_value("text"),
+            "Format of the read-ID output: text (tab-separated read-IDs), or binary "
+            "(compact format for filterfq).")
+        ("output-r1", po::value<string>(&output_r1),
+            "Write the reads which are not duplicates of an earlier read to this FASTQ "
+            "file (read 1), while analysing. Compressed if the name ends in .gz.")
+        ("output-r2", po::value<string>(&output_r2),
+            "Write the read 2 records of the reads which are not duplicates to this "
+            "FASTQ file (with --output-r1).")
+        ("detect-r1-only", po::bool_switch(&detect_r1_only),
+            "Use only read 1 to detect the duplicates in paired-end data. Read 2 is only "
+            "filtered (with --output-r2), as in filter.sh.")
+        ("gzip-output", po::bool_switch(&gzip_output),
+            "Compress the read-ID output and the filtered FASTQ output with gzip.")
         ("single,1", po::bool_switch(&single_thread), "Disable multithreading")
+        ("threads,t", po::value<unsigned int>(&num_threads)->default_value(4),
+            "Number of threads for decompression of each input file (BGZF format), and "
+            "for compression of each filtered FASTQ output file. Plain gzip files are "
+            "decompressed by one thread.")
+        ("encode-threads", po::value<unsigned int>(&pipeline.encode_threads)->default_value(1),
+            "Number of threads for encoding and hashing the sequences. File parsing and "
+            "analysis use one thread each.")
+        ("tile-threads", po::value<unsigned int>(&pipeline.tile_threads)->default_value(0),
+            "Number of threads for analysing tiles in parallel. Each thread uses a separate "
+            "hash table of size --hash-size. Not for unsorted files. 0 means the analysis "
+            "is done in a single thread.")
+        ("band-height", po::value<int>(&pipeline.band_height)->default_value(0),
+            "Split the tiles into bands of this height (pixels) in the y direction, which "
+            "are analysed in parallel by the tile threads. Must be at least winy. Only for "
+            "sorted files, with --tile-threads.")
+        ("queue-depth", po::value<size_t>(&pipeline.queue_depth)->default_value(4),
+            "Number of batches of reads that can be queued between the stages of the "
+            "analysis.")
+        ("stage-times", po::bool_switch(&stage_times),
+            "Report the busy and idle time of each stage of the analysis at the end "
+            "of the run, to identify the bottleneck (not with --single).")
+        ("prefetch-distance", po::value<unsigned int>(&pipeline.prefetch_distance)
+                ->default_value(PREFETCH_DISTANCE),
+            "Number of reads to look ahead when prefetching the hash table. 0 disables "
+            "prefetching.")
+        ("table", po::value<string>(&table_engine)->default_value("chained"),
+            "Hash table engine: chained (linked lists of entries), or open (open addressing "
+            "with fingerprints, grows automatically).")
         ("hash-size", po::value<size_t>(&hash_bytes)->default_value(512*1024*8), 
-            "Hash table size (bytes), must be a power of 2. (increase if winy>2500).")
+            "Initial hash table size (bytes). The table grows automatically when needed.")
+        ("shrink-hash", po::bool_switch(&shrink_table),
+            "Shrink the hash table between tiles, to fit the largest number of entries in "
+            "the previous tile (sorted and region-sorted modes).")
+        ("hash-stats", po::bool_switch(&hash_stats),
+            "Report histograms of the number of entries examined for each read, and of "
+            "the lengths of the lists in the hash table at the end of each tile.")
+        ("set-sizes", po::bool_switch(&pipeline.set_sizes),
+            "Report a histogram of the sizes of the sets of local duplicates (reads which "
+            "are connected by being duplicates of each other). Not with --band-height.")
         ("help,h", "Show this help message")
     ;
     po::options_description positionals("Positional options(hidden)");
@@ -649,7 +271,81 @@ int main(int argc, char* argv[]) {
       return 1; 
     }
 
-    InputSelector isel(inputfile1, !single_thread);
+    if (table_engine != "chained" && table_engine != "open") {
+        cerr << "ERROR: Invalid table engine '" << table_engine << "', must be chained or open."
+             << endl;
+        return 1;
+    }
+    const bool open_table = table_engine == "open";
+
+    if (pair_format != "text" && pair_format != "binary") {
+        cerr << "ERROR: Invalid pair format '" << pair_format << "', must be text or binary."
+             << endl;
+        return 1;
+    }
+    const bool binary_pairs = pair_format == "binary";
+
+    // suprDUPr.read_id is the same program, with --read-ids always enabled
+    if (endsWith(argv[0], ".read_id")) {
+        read_ids = true;
+    }
+
+    const bool filter = !output_r1.empty();
+    if (binary_pairs && !read_ids) {
+        cerr << "ERROR: The option --pair-format is only for the read-ID output." << endl;
+        return 1;
+    }
+    if (gzip_output && !read_ids && !filter) {
+        cerr << "ERROR: The option --gzip-output is only for the read-ID output and the "
+             << "filtered output." << endl;
+        return 1;
+    }
+    if (!output_r2.empty() && (!filter || vm.count("input-file-r2") == 0)) {
+        cerr << "ERROR: The option --output-r2 requires --output-r1 and a read 2 input file."
+             << endl;
+        return 1;
+    }
+    if (detect_r1_only && vm.count("input-file-r2") == 0) {
+        cerr << "ERROR: The option --detect-r1-only requires a read 2 input file." << endl;
+        return 1;
+    }
+
+    if (single_thread) {
+        num_threads = 0;
+        pipeline.encode_threads = 0;
+        pipeline.tile_threads = 0;
+    }
+    else {
+        if (num_threads == 0) num_threads = 1;
+        if (pipeline.encode_threads == 0) pipeline.encode_threads = 1;
+        if (pipeline.queue_depth == 0) pipeline.queue_depth = 1;
+    }
+    if (unsorted && pipeline.tile_threads > 0) {
+        cerr << "ERROR: Tile-parallel analysis (--tile-threads) requires a sorted or "
+             << "region-sorted file." << endl;
+        return 1;
+    }
+    if (pipeline.band_height < 0) {
+        pipeline.band_height = 0;
+    }
+    else if (pipeline.band_height > 0) {
+        if (pipeline.tile_threads == 0 || unsorted || region_sorted) {
+            cerr << "ERROR: Analysis in y-bands (--band-height) requires a sorted file, and "
+                 << "--tile-threads." << endl;
+            return 1;
+        }
+        else if (pipeline.band_height < (int)winy) {
+            cerr << "ERROR: The band height must be at least winy (" << winy << ")." << endl;
+            return 1;
+        }
+        else if (pipeline.set_sizes) {
+            // The sets which cross the band boundaries would be split
+            cerr << "ERROR: The option --set-sizes can't be used with --band-height." << endl;
+            return 1;
+        }
+    }
+
+    InputSelector isel(inputfile1, num_threads);
     if (!isel.valid) {
         if (inputfile1 == "-") {
             cerr << "ERROR: Cannot open standard input: " << strerror(errno) << "\n";
@@ -659,21 +355,56 @@ int main(int argc, char* argv[]) {
         }
         return 1;
     }
-    istream&input = *isel.input;
+    FastqReader& input = *isel.reader;
 
-    istream* input2 = nullptr;
+    FastqReader* input2 = nullptr;
+    InputSelector* iselr2 = nullptr;
     if (vm.count("input-file-r2") == 1) {
-        InputSelector* iselr2 = new InputSelector(inputfile2, !single_thread);
+        iselr2 = new InputSelector(inputfile2, num_threads);
         if (!iselr2->valid) {
             cerr << "ERROR: Cannot open file " << inputfile2 << ": " << strerror(errno) << "\n";
             return 1;
         }
-        input2 = iselr2->input;
+        input2 = iselr2->reader;
     }
 
     // Empty file is a valid input; output zeros
-    input.peek();
-    empty_file = input.eof();
+    empty_file = input.atEnd();
+
+    // The read-IDs are written to STDOUT by a separate thread (except with
+    // --single), so the analysis doesn't wait for the output
+    unique_ptr<OutputWriter> output_writer;
+    unique_ptr<ostream> read_id_output;
+    if (read_ids) {
+        output_writer.reset(new OutputWriter(cout, gzip_output, !single_thread));
+        read_id_output.reset(new ostream(output_writer.get()));
+        if (binary_pairs) {
+            read_id_output->write(pair_format_magic, sizeof(pair_format_magic));
+        }
+    }
+    ostream& output = read_ids ? *read_id_output : cout;
+
+    // The filtered FASTQ files are also written by separate threads, and
+    // compressed in the BGZF format by num_threads threads each
+    const string filtered_names[2] = {output_r1, output_r2};
+    ofstream filtered_files[2];
+    unique_ptr<OutputWriter> filtered_writers[2];
+    unique_ptr<ostream> filtered_outputs[2];
+    for (int r=0; r<2; ++r) {
+        if (filtered_names[r].empty()) continue;
+        filtered_files[r].open(filtered_names[r], ios_base::out | ios_base::binary);
+        if (!filtered_files[r]) {
+            cerr << "ERROR: Cannot open output file " << filtered_names[r] << ": "
+                 << strerror(errno) << endl;
+            return 1;
+        }
+        filtered_writers[r].reset(new OutputWriter(filtered_files[r],
+                    gzip_output || endsWith(filtered_names[r], ".gz"), !single_thread,
+                    FILTER_GZIP_LEVEL, num_threads));
+        filtered_outputs[r].reset(new ostream(filtered_writers[r].get()));
+        pipeline.filtered_output[r] = filtered_outputs[r].get();
+    }
+    pipeline.detect_r1_only = detect_r1_only;
 
     cerr << "-- suprDUPr v1.3 --\n";
 
@@ -685,7 +416,7 @@ int main(int argc, char* argv[]) {
     Metrics result;
 
     size_t total_str_len;
-    if (input2) {
+    if (input2 && !detect_r1_only) {
         total_str_len = str_len_per_read*2;
         cerr << "Using positions from " << first_base << " to "
              << first_base+str_len_per_read << " in each of read 1 "
@@ -706,10 +437,11 @@ int main(int argc, char* argv[]) {
             << "data, are not supported (check parameters --start, --end)" << endl;
         return 1;
     }
-#define callAnalysisLoop(size) result = analysisLoop<TwoBitSequence<size>>(\
-                cout, hash_bytes, first_base, str_len_per_read, winx, winy,\
-                region_sorted, unsorted, input, input2\
-                )
+#define analysisLoopArgs open_table, read_ids, binary_pairs, output, hash_bytes, first_base,\
+                str_len_per_read, winx, winy, region_sorted, unsorted, shrink_table,\
+                hash_stats, input, input2, pipeline
+#define callAnalysisLoop(size) result = \
+        selectAnalysisLoop<TwoBitSequence<size>>(analysisLoopArgs)
     else if (total_str_len > 288) callAnalysisLoop(10);
     else if (total_str_len > 256) callAnalysisLoop(9);
     else if (total_str_len > 224) callAnalysisLoop(8);
@@ -726,16 +458,82 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    bool output_ok = !output_writer || output_writer->close();
+    for (int r=0; r<2; ++r) {
+        if (filtered_writers[r] && !filtered_writers[r]->close()) {
+            cerr << "ERROR: Unable to write to " << filtered_names[r] << "." << endl;
+            output_ok = false;
+        }
+    }
+
+    if (stage_times && pipeline.encode_threads > 0 && !empty_file) {
+        // The parser's time waiting for decompressed data is idle time, and so
+        // is the time waiting for the output writer
+        pipeline.parse_timer.addIdle(isel.readWaitTime());
+        if (iselr2) pipeline.parse_timer.addIdle(iselr2->readWaitTime());
+        if (output_writer) {
+            (pipeline.tile_threads == 0 ? pipeline.analysis_timer : pipeline.output_timer)
+                .addIdle(output_writer->writeWaitTime());
+        }
+        for (int r=0; r<2; ++r) {
+            if (filtered_writers[r]) {
+                (pipeline.tile_threads == 0 ? pipeline.analysis_timer : pipeline.filter_timer)
+                    .addIdle(filtered_writers[r]->writeWaitTime());
+            }
+        }
+        cerr << "\nPipeline stage times:\n";
+        StageTimer::reportHeader(cerr);
+        isel.reportStageTimes(cerr, "decompress R1");
+        if (iselr2) iselr2->reportStageTimes(cerr, "decompress R2");
+        pipeline.parse_timer.report(cerr, "parse");
+        for (size_t i=0; i<pipeline.encode_timers.size(); ++i) {
+            pipeline.encode_timers[i].report(cerr, "encode " + to_string(i+1));
+        }
+        if (pipeline.tile_threads == 0) {
+            pipeline.analysis_timer.report(cerr, "analyse");
+        }
+        else {
+            pipeline.analysis_timer.report(cerr, "dispatch tiles");
+            for (size_t i=0; i<pipeline.tile_timers.size(); ++i) {
+                pipeline.tile_timers[i].report(cerr, "analyse tiles " + to_string(i+1));
+            }
+            pipeline.output_timer.report(cerr, "output");
+            if (filter) pipeline.filter_timer.report(cerr, "filter output");
+        }
+        if (output_writer) output_writer->reportStageTimes(cerr, "write output");
+        for (int r=0; r<2; ++r) {
+            if (filtered_writers[r]) {
+                filtered_writers[r]->reportStageTimes(cerr, "write filtered R" + to_string(r+1));
+            }
+        }
+        cerr << endl;
+    }
+
     if (result.error) {
         return 1; // error flag
     }
-    else if (input.eof() && cout.good()) {
+    else if (input.eof() && output_ok && cout.good()) {
         cerr << "Completed. Analysed " << result.num_reads << " records." << endl;
-#ifdef OUTPUT_READ_ID
-        ostream& statsstream = cerr;
-#else
-        ostream& statsstream = cout;
-#endif
+        if (result.table_bytes > 0) {
+            cerr << "Final hash table size: " << result.table_bytes << " bytes." << endl;
+        }
+        if (hash_stats) {
+            cerr << '\n';
+            result.walk_lengths.print(cerr, open_table ?
+                    "Slots probed per read:" : "Entries examined per read:");
+            cerr << '\n';
+            result.list_lengths.print(cerr, open_table ?
+                    "Lengths of runs of used slots, at the end of each tile:" :
+                    "Lengths of the lists in the hash table, at the end of each tile:");
+            cerr << endl;
+        }
+        if (pipeline.set_sizes) {
+            cerr << '\n';
+            result.set_sizes.print(cerr, "Sizes of the sets of local duplicates (reads):");
+            cerr << endl;
+        }
+        // In read-ID mode, STDOUT is reserved for the read-IDs
+        ostream& statsstream = read_ids ? cerr : cout;
         statsstream << "NUM_READS\tREADS_WITH_DUP\tDUP_RATIO\n";
         statsstream << result.num_reads 
                     << '\t' << result.reads_with_duplicates 
@@ -745,11 +543,14 @@ int main(int argc, char* argv[]) {
     }
     else {
         if (input.bad()) {
-            cerr << "ERROR: read: " << strerror(errno) << endl;
+            cerr << "ERROR: read: " << isel.errorMessage() << endl;
         }
-        else {
+        else if (!cout.good()) {
+            cerr << "ERROR: Unable to write to the standard output." << endl;
+        }
+        else if (output_ok) { // Output errors have been reported above
             cerr << "ERROR: Unexpected problem!" << endl;
-            cerr << "good=" << input.good() << ", eof=" << input.eof() << endl;
+            cerr << "eof=" << input.eof() << endl;
         }
         return 1;
     }